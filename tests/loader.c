@@ -0,0 +1,92 @@
+#define TSF_IMPLEMENTATION
+#include "../tsf.h"
+
+#include "tests.h"
+
+// The minimal SoundFont of example1 with an instrument zone key range of 100 to 20 (lower bound above the upper bound)
+static const unsigned char InvertedKeyRangeSoundFont[] =
+{
+	'R','I','F','F',224,1,0,0,'s','f','b','k',
+	'L','I','S','T',92,1,0,0,'p','d','t','a',
+	'p','h','d','r',76,TEN0,TEN0,TEN0,TEN0,0,0,0,0,TEN0,0,0,0,0,0,0,0,255,0,255,0,1,TEN0,0,0,0,
+	'p','b','a','g',8,0,0,0,0,0,0,0,1,0,0,0,'p','m','o','d',10,TEN0,0,0,0,'p','g','e','n',8,0,0,0,41,0,0,0,0,0,0,0,
+	'i','n','s','t',44,TEN0,TEN0,0,0,0,0,0,0,0,0,TEN0,0,0,0,0,0,0,0,1,0,
+	'i','b','a','g',8,0,0,0,0,0,0,0,3,0,0,0,'i','m','o','d',10,TEN0,0,0,0,
+	'i','g','e','n',16,0,0,0,43,0,100,20,54,0,1,0,53,0,0,0,0,0,0,0,
+	's','h','d','r',92,TEN0,TEN0,0,0,0,0,0,0,0,50,0,0,0,0,0,0,0,49,0,0,0,34,86,0,0,60,0,0,0,1,TEN0,TEN0,TEN0,TEN0,0,0,0,0,0,0,0,
+	'L','I','S','T',112,0,0,0,'s','d','t','a','s','m','p','l',100,0,0,0,86,0,119,3,31,7,147,10,43,14,169,17,58,21,189,24,73,28,204,31,73,35,249,38,46,42,71,46,250,48,150,53,242,55,126,60,151,63,108,66,126,72,207,
+		70,86,83,100,72,74,100,163,39,241,163,59,175,59,179,9,179,134,187,6,186,2,194,5,194,15,200,6,202,96,206,159,209,35,213,213,216,45,220,221,223,76,227,221,230,91,234,242,237,105,241,8,245,118,248,32,252
+};
+
+static void TestInvertedKeyRange(void)
+{
+	// The zone with the inverted key range plays no keys but the font still loads and the key index stays in bounds
+	float buffer[64];
+	int key;
+	tsf* f = tsf_load_memory(InvertedKeyRangeSoundFont, sizeof(InvertedKeyRangeSoundFont));
+	CHECK(f != NULL);
+	if (!f) return;
+	CHECK(tsf_get_presetcount(f) == 1);
+	tsf_set_output(f, TSF_MONO, 44100, 0.0f);
+	for (key = 0; key != 128; key++) CHECK(tsf_note_on(f, 0, key, 1.0f));
+	CHECK(tsf_active_voice_count(f) == 0);
+	tsf_render_float(f, buffer, 64, 0);
+	tsf_close(f);
+}
+
+static void RenderPreset(tsf* f, int preset_index, float* buffer, int samples)
+{
+	float fade[64];
+	tsf_note_on(f, preset_index, 60, 1.0f);
+	tsf_render_float(f, buffer, samples, 0);
+	tsf_reset(f);
+	while (tsf_active_voice_count(f)) tsf_render_float(f, fade, 64, 0);
+}
+
+static int PresetsSoundEqual(tsf* f, tsf* g, int preset_index)
+{
+	float a[256], b[256];
+	int i;
+	RenderPreset(f, preset_index, a, 256);
+	RenderPreset(g, preset_index, b, 256);
+	for (i = 0; i != 256; i++) if (a[i] - b[i] > 1e-6f || b[i] - a[i] > 1e-6f) return 0;
+	return 1;
+}
+
+static void TestLazyLoad(void)
+{
+	// Presets of a lazily loaded font read their samples on first use, sound like a complete load and
+	// get freed least recently used first under a memory limit
+	tsf *full = tsf_load_filename("../examples/florestan-subset.sf2"), *lazy = tsf_load_filename_lazy("../examples/florestan-subset.sf2");
+	struct tsf_preset* presets;
+	size_t limit;
+	int i;
+	CHECK(full != NULL && lazy != NULL);
+	if (!full || !lazy) { if (full) tsf_close(full); if (lazy) tsf_close(lazy); return; }
+	CHECK(tsf_get_presetcount(lazy) == tsf_get_presetcount(full) && tsf_get_presetcount(lazy) >= 2);
+	tsf_set_output(full, TSF_MONO, 44100, 0.0f);
+	tsf_set_output(lazy, TSF_MONO, 44100, 0.0f);
+	presets = lazy->font->presets;
+	for (i = 0; i != tsf_get_presetcount(lazy); i++) CHECK(presets[i].samples == NULL);
+	for (i = 0; i != tsf_get_presetcount(lazy); i++) CHECK(PresetsSoundEqual(full, lazy, i));
+	CHECK(tsf_preload_preset(lazy, 1));
+
+	// With room for only one of the first two presets, reading preset 0 frees preset 1 and the other way around
+	limit = (presets[0].sampleNum > presets[1].sampleNum ? presets[0].sampleNum : presets[1].sampleNum) * sizeof(tsf_sample);
+	tsf_set_max_sample_memory(lazy, limit);
+	CHECK(lazy->font->residentBytes <= limit);
+	CHECK(tsf_preload_preset(lazy, 0));
+	CHECK(presets[0].samples != NULL && presets[1].samples == NULL);
+	CHECK(PresetsSoundEqual(full, lazy, 1));
+	CHECK(presets[0].samples == NULL && presets[1].samples != NULL);
+	CHECK(lazy->font->residentBytes <= limit);
+	tsf_close(full);
+	tsf_close(lazy);
+}
+
+int main(void)
+{
+	TestInvertedKeyRange();
+	TestLazyLoad();
+	return TestsResult();
+}
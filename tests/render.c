@@ -0,0 +1,157 @@
+#define TSF_IMPLEMENTATION
+#include "../tsf.h"
+
+#include "tests.h"
+
+static tsf* LoadMinimal(void)
+{
+	tsf* f = tsf_load_memory(MinimalSoundFont, sizeof(MinimalSoundFont));
+	if (f) tsf_set_output(f, TSF_MONO, 44100, 0.0f);
+	return f;
+}
+
+static int BuffersEqual(const float* a, const float* b, int samples)
+{
+	int i;
+	for (i = 0; i != samples; i++) if (a[i] != b[i]) return 0;
+	return 1;
+}
+
+static void TestQueue(void)
+{
+	// Events sent through the queue handle only take effect on the next render and sound like calling f directly
+	float queued[256], direct[256];
+	int sent;
+	tsf *f = LoadMinimal(), *g = LoadMinimal(), *q = (f ? tsf_create_queue(f, 10) : TSF_NULL);
+	CHECK(f != NULL && g != NULL && q != NULL);
+	if (!f || !g || !q) { if (q) tsf_close(q); if (f) tsf_close(f); if (g) tsf_close(g); return; }
+	CHECK(tsf_create_queue(f, 10) == NULL);
+	CHECK(tsf_channel_set_presetindex(q, 3, 0));
+	CHECK(tsf_channel_note_on(q, 3, 60, 1.0f));
+	CHECK(tsf_active_voice_count(f) == 0);
+	tsf_render_float(f, queued, 128, 0);
+	CHECK(tsf_active_voice_count(f) == 1);
+	tsf_channel_note_off(q, 3, 60);
+	tsf_render_float(f, queued + 128, 128, 0);
+
+	tsf_channel_set_presetindex(g, 3, 0);
+	tsf_channel_note_on(g, 3, 60, 1.0f);
+	tsf_render_float(g, direct, 128, 0);
+	tsf_channel_note_off(g, 3, 60);
+	tsf_render_float(g, direct + 128, 128, 0);
+	CHECK(BuffersEqual(queued, direct, 256));
+
+	// max_events is rounded up to 16, the event after that is refused until the queue is applied
+	for (sent = 0; sent != 16; sent++) CHECK(tsf_note_on(q, 0, 40 + sent, 1.0f));
+	CHECK(!tsf_note_on(q, 0, 70, 1.0f));
+	tsf_render_float(f, queued, 64, 0);
+	CHECK(tsf_active_voice_count(f) == 17);
+	CHECK(tsf_note_on(q, 0, 70, 1.0f));
+	tsf_close(q);
+	tsf_close(f);
+	tsf_close(g);
+}
+
+static void TestEventOffsets(void)
+{
+	// Events are applied at their sample offset, like rendering up to the offset and calling the function there
+	float evented[256], split[256];
+	struct tsf_event events[2];
+	int i;
+	tsf *f = LoadMinimal(), *g = LoadMinimal();
+	CHECK(f != NULL && g != NULL);
+	if (!f || !g) { if (f) tsf_close(f); if (g) tsf_close(g); return; }
+	TSF_MEMSET(events, 0, sizeof(events));
+	events[0].offset = 37;
+	events[0].type = TSF_EVENT_NOTE_ON;
+	events[0].param2 = 60;
+	events[0].value = 1.0f;
+	events[1].offset = 200;
+	events[1].type = TSF_EVENT_NOTE_OFF;
+	events[1].param2 = 60;
+	tsf_render_float_events(f, evented, 256, events, 2, 0);
+	for (i = 0; i != 37; i++) CHECK(evented[i] == 0.0f);
+	for (; i != 256 && evented[i] == 0.0f; i++) {}
+	CHECK(i != 256);
+
+	tsf_render_float(g, split, 37, 0);
+	tsf_note_on(g, 0, 60, 1.0f);
+	tsf_render_float(g, split + 37, 200 - 37, 0);
+	tsf_note_off(g, 0, 60);
+	tsf_render_float(g, split + 200, 256 - 200, 0);
+	CHECK(BuffersEqual(evented, split, 256));
+	tsf_close(f);
+	tsf_close(g);
+}
+
+static void TestParallelRender(void)
+{
+	// Rendering with the parallel functions gives the same output and ends the same voices as tsf_render_float
+	float single[128], parallel[128], workerBuffers[2][128];
+	float* workers[2];
+	int block, i, key;
+	tsf *f = LoadMinimal(), *g = LoadMinimal();
+	CHECK(f != NULL && g != NULL);
+	if (!f || !g) { if (f) tsf_close(f); if (g) tsf_close(g); return; }
+	workers[0] = workerBuffers[0];
+	workers[1] = workerBuffers[1];
+	tsf_set_output(f, TSF_STEREO_INTERLEAVED, 44100, 0.0f);
+	tsf_set_output(g, TSF_STEREO_INTERLEAVED, 44100, 0.0f);
+	for (key = 48; key != 72; key += 3) { tsf_note_on(f, 0, key, 0.8f); tsf_note_on(g, 0, key, 0.8f); }
+	for (block = 0; block != 8; block++)
+	{
+		if (block == 2) { tsf_note_off_all(f); tsf_note_off_all(g); }
+		tsf_render_float(f, single, 64, 0);
+		tsf_render_parallel_begin(g);
+		tsf_render_parallel_worker(g, workers[0], 64);
+		tsf_render_parallel_worker(g, workers[1], 64);
+		tsf_render_parallel_end(g, parallel, workers, 2, 64, 0);
+		for (i = 0; i != 128; i++) CHECK(single[i] - parallel[i] < 1e-6f && parallel[i] - single[i] < 1e-6f);
+		CHECK(tsf_active_voice_count(f) == tsf_active_voice_count(g));
+	}
+	tsf_close(f);
+	tsf_close(g);
+}
+
+static void RenderNote(tsf* f, int key, float* buffer, int samples)
+{
+	// Render one note and let the voice fade out after tsf_reset so the next note starts from silence
+	float fade[64];
+	tsf_note_on(f, 0, key, 1.0f);
+	tsf_render_float(f, buffer, samples, 0);
+	tsf_reset(f);
+	while (tsf_active_voice_count(f)) tsf_render_float(f, fade, 64, 0);
+}
+
+static void TestInterpolationModes(void)
+{
+	// Each interpolation mode renders its own bounded output and switching back to linear restores the linear output
+	float linear[512], cubic[512], sinc[512], again[512];
+	int i;
+	tsf* f = LoadMinimal();
+	CHECK(f != NULL);
+	if (!f) return;
+	RenderNote(f, 79, linear, 512);
+	CHECK(tsf_set_interpolation(f, TSF_INTERPOLATION_CUBIC));
+	RenderNote(f, 79, cubic, 512);
+	CHECK(tsf_set_interpolation(f, TSF_INTERPOLATION_SINC));
+	RenderNote(f, 79, sinc, 512);
+	CHECK(tsf_set_interpolation(f, TSF_INTERPOLATION_LINEAR));
+	RenderNote(f, 79, again, 512);
+	CHECK(!BuffersEqual(linear, cubic, 512));
+	CHECK(!BuffersEqual(linear, sinc, 512));
+	CHECK(!BuffersEqual(cubic, sinc, 512));
+	CHECK(BuffersEqual(linear, again, 512));
+	for (i = 0; i != 512; i++)
+		CHECK(linear[i] > -2.0f && linear[i] < 2.0f && cubic[i] > -2.0f && cubic[i] < 2.0f && sinc[i] > -2.0f && sinc[i] < 2.0f);
+	tsf_close(f);
+}
+
+int main(void)
+{
+	TestQueue();
+	TestEventOffsets();
+	TestParallelRender();
+	TestInterpolationModes();
+	return TestsResult();
+}
@@ -0,0 +1,59 @@
+#define TSF_IMPLEMENTATION
+#include "../tsf.h"
+
+#include "tests.h"
+
+static void TestStealAfterReset(void)
+{
+	// Voices still releasing after tsf_reset keep the channel they played on while the channels get set up again
+	float buffer[64];
+	int key;
+	tsf* f = tsf_load_memory(MinimalSoundFont, sizeof(MinimalSoundFont));
+	CHECK(f != NULL);
+	if (!f) return;
+	tsf_set_output(f, TSF_MONO, 44100, 0.0f);
+	CHECK(tsf_set_max_voices(f, 4));
+	tsf_set_voice_stealing(f, TSF_STEAL_CHANNEL_PRIORITY);
+	CHECK(tsf_channel_set_presetindex(f, 5, 0));
+	for (key = 60; key != 64; key++) CHECK(tsf_channel_note_on(f, 5, key, 1.0f));
+	tsf_reset(f);
+	CHECK(tsf_active_voice_count(f) == 4);
+	CHECK(tsf_channel_set_presetindex(f, 0, 0));
+	CHECK(tsf_channel_note_on(f, 0, 72, 1.0f));
+	tsf_render_float(f, buffer, 64, 0);
+	tsf_close(f);
+}
+
+// Clock for the render budget that advances by one millisecond on each call
+static double FakeClockTime;
+static double FakeClock(void) { return (FakeClockTime += 0.001); }
+
+static void TestBudgetTakesQuietest(void)
+{
+	// Over the render budget new notes take over the quietest voice even without releasing voices
+	float buffer[64];
+	int *active;
+	tsf* f = tsf_load_memory(MinimalSoundFont, sizeof(MinimalSoundFont));
+	CHECK(f != NULL);
+	if (!f) return;
+	tsf_set_output(f, TSF_MONO, 44100, 0.0f);
+	CHECK(tsf_note_on(f, 0, 60, 1.0f));
+	CHECK(tsf_note_on(f, 0, 62, 0.1f));
+
+	// Rendering 2 voices for 64 samples in 1 ms measured by the clock lets 2.9 voices fit into the full buffer duration
+	tsf_set_render_budget(f, FakeClock, 1.0f);
+	tsf_render_float(f, buffer, 64, 0);
+	CHECK(tsf_active_voice_count(f) == 2);
+	CHECK(tsf_note_on(f, 0, 64, 1.0f));
+	CHECK(tsf_active_voice_count(f) == 2);
+	for (active = f->activeVoices; active != f->activeVoices + f->activeVoiceNum; active++)
+		CHECK(f->voices[*active].playingKey != 62);
+	tsf_close(f);
+}
+
+int main(void)
+{
+	TestStealAfterReset();
+	TestBudgetTakesQuietest();
+	return TestsResult();
+}
@@ -10,9 +10,15 @@
    #include "tsf.h"
 
    [OPTIONAL] #define TSF_NO_STDIO to remove stdio dependency
+   [OPTIONAL] #define TSF_NO_MMAP to remove tsf_load_mmap and its dependency on the OS file mapping functions
    [OPTIONAL] #define TSF_MALLOC, TSF_REALLOC, and TSF_FREE to avoid stdlib.h
    [OPTIONAL] #define TSF_MEMCPY, TSF_MEMSET to avoid string.h
-   [OPTIONAL] #define TSF_POW, TSF_POWF, TSF_EXPF, TSF_LOG, TSF_TAN, TSF_LOG10, TSF_SQRT to avoid math.h
+   [OPTIONAL] #define TSF_POW, TSF_POWF, TSF_EXPF, TSF_LOG, TSF_TAN, TSF_COS, TSF_LOG10, TSF_SQRT to avoid math.h
+   [OPTIONAL] #define TSF_NO_SIMD to disable the SSE2/AVX2/NEON voice rendering and only use the plain C code
+   [OPTIONAL] #define TSF_FIXEDPOINT_PHASE to track sample playback positions as 32.32 fixed point integers instead of double
+   [OPTIONAL] #define TSF_SAMPLES_SHORT to keep the SoundFont samples as 16-bit integers in memory instead of float (halves memory usage)
+   [OPTIONAL] #define TSF_FAST_MATH to replace the pow and tan calls of the note and render code with polynomial approximations
+                (each approximation has a relative error below 1e-8, the rendered output differs from exact math by less than 1e-5)
 
    NOT YET IMPLEMENTED
      - Support for ChorusEffectsSend and ReverbEffectsSend generators
@@ -45,6 +51,8 @@
 #ifndef TSF_INCLUDE_TSF_INL
 #define TSF_INCLUDE_TSF_INL
 
+#include <stddef.h>
+
 #ifdef __cplusplus
 extern "C" {
 #  define CPP_DEFAULT0 = 0
@@ -68,11 +76,28 @@ typedef struct tsf tsf;
 #ifndef TSF_NO_STDIO
 // Directly load a SoundFont from a .sf2 file path
 TSFDEF tsf* tsf_load_filename(const char* filename);
+
+// Load a SoundFont from a .sf2 file path but only read the preset and instrument data up front
+// The samples used by a preset are read from the file (which is kept open until closing) when the
+// preset is first selected on a channel, played or passed to tsf_preload_preset.
+// SoundFonts with compressed samples are loaded completely like with tsf_load_filename.
+// Instances created with tsf_copy share the read samples. Only one thread reads from the file at a time,
+// a note or preset selection that needs to read while another thread is reading fails (returns 0) instead
+// of waiting, use tsf_preload_preset outside of the render thread to avoid this.
+TSFDEF tsf* tsf_load_filename_lazy(const char* filename);
 #endif
 
 // Load a SoundFont from a block of memory
 TSFDEF tsf* tsf_load_memory(const void* buffer, int size);
 
+#ifndef TSF_NO_MMAP
+// Load a SoundFont from a .sf2 file path by mapping the file into memory read-only
+// If TSF_SAMPLES_SHORT is defined the sample data is used directly from the mapping which
+// means it is only paged in when played and shared by all processes that map the same file.
+// Otherwise the samples get converted like with the other load functions and the file is unmapped.
+TSFDEF tsf* tsf_load_mmap(const char* filename);
+#endif
+
 // Stream structure for the generic loading
 struct tsf_stream
 {
@@ -89,12 +114,46 @@ struct tsf_stream
 // Generic SoundFont loading method using the stream structure above
 TSFDEF tsf* tsf_load(struct tsf_stream* stream);
 
+// Allocator structure for tsf_load_allocator, all three functions need to be set
+struct tsf_allocator
+{
+	// Custom data given to the functions as the first parameter
+	void* data;
+
+	// Function pointer will be called to allocate 'size' bytes (returns NULL on failure)
+	void* (*allocate)(void* data, size_t size);
+
+	// Function pointer will be called to resize an allocated block or allocate a new one if ptr is NULL
+	// (returns NULL on failure in which case the old block stays valid)
+	void* (*reallocate)(void* data, void* ptr, size_t size);
+
+	// Function pointer will be called to free an allocated block (never called with NULL)
+	void (*deallocate)(void* data, void* ptr);
+};
+
+// Generic SoundFont loading method which makes all memory allocations of the loader, the loaded
+// SoundFont and all tsf instances using it (including copies) through the given allocator.
+// The preset table, regions and key lookup indices are placed together in a single allocation.
+// The allocator structure is copied but its data needs to stay valid until the last instance is closed.
+TSFDEF tsf* tsf_load_allocator(struct tsf_stream* stream, const struct tsf_allocator* allocator);
+
 // Copy a tsf instance from an existing one, use tsf_close to close it as well.
 // All copied tsf instances and their original instance are linked, and share the underlying soundfont.
 // This allows loading a soundfont only once, but using it for multiple independent playbacks.
-// (This function isn't thread-safe without locking.)
+// The shared soundfont is reference counted atomically, instances can be copied and closed on
+// different threads at the same time (as long as each single instance is used by one thread).
 TSFDEF tsf* tsf_copy(tsf* f);
 
+// Create a handle to send note and channel events to a tsf instance from another thread.
+// Calling the tsf_note_* and tsf_channel_* functions (and tsf_reset) on the returned handle
+// adds the events to a lock-free queue which is applied by the next tsf_render_* call of f.
+// Their return value on the handle only reports whether the event was queued (0 if the queue is full),
+// for example tsf_channel_set_presetnumber can't tell if the preset exists until f applies the event.
+// There can only be one queue handle for each tsf instance, use tsf_close on it before closing f.
+//   max_events: number of events that can be pending (rounded up to a power of two)
+//   (returns TSF_NULL if allocation failed or if f already has a queue handle)
+TSFDEF tsf* tsf_create_queue(tsf* f, int max_events);
+
 // Free the memory related to this tsf instance
 TSFDEF void tsf_close(tsf* f);
 
@@ -124,21 +183,48 @@ enum TSFOutputMode
 	TSF_MONO
 };
 
+// Supported interpolation modes used to resample the SoundFont samples to the output pitch
+enum TSFInterpolation
+{
+	// Two neighboring samples are interpolated linearly (fastest)
+	TSF_INTERPOLATION_LINEAR,
+	// Four samples are interpolated with a cubic Hermite (Catmull-Rom) spline
+	TSF_INTERPOLATION_CUBIC,
+	// Eight samples are filtered with a windowed sinc from a precomputed polyphase table (highest quality)
+	TSF_INTERPOLATION_SINC
+};
+
+// Supported policies to pick the voice that gets taken over when no free voice is left
+enum TSFVoiceSteal
+{
+	// Only voices in their release are taken, the one furthest into it (new notes are dropped otherwise)
+	TSF_STEAL_RELEASED,
+	// The voice that started playing first
+	TSF_STEAL_OLDEST,
+	// The voice with the lowest current amplitude envelope level and note gain
+	TSF_STEAL_QUIETEST,
+	// A voice playing the same key on the same channel and preset as the new note (any channel for notes started
+	// with tsf_note_on), otherwise the oldest
+	TSF_STEAL_SAME_KEY,
+	// The oldest voice on the channel with the lowest priority set by tsf_channel_set_priority
+	TSF_STEAL_CHANNEL_PRIORITY
+};
+
 // Thread safety:
 //
 // 1. Rendering / voices:
 //
 // Your audio output which calls the tsf_render* functions will most likely
 // run on a different thread than where the playback tsf_note* functions
-// are called. In which case some sort of concurrency control like a
-// mutex needs to be used so they are not called at the same time.
-// Alternatively, you can pre-allocate a maximum number of voices that can
-// play simultaneously by calling tsf_set_max_voices after loading.
-// That way memory re-allocation will not happen during tsf_note_on and
-// TSF should become mostly thread safe.
-// There is a theoretical chance that ending notes would negatively influence
-// a voice that is rendering at the time but it is hard to say.
-// Also be aware, this has not been tested much.
+// are called. Both modify the lists of active and free voices, so they
+// must never run at the same time, even with pre-allocated voices.
+// Call the playback functions on a handle returned by tsf_create_queue,
+// then all events get applied on the render thread without any locking.
+// Otherwise some sort of concurrency control like a mutex needs to be used
+// around every tsf_note*, tsf_channel* and tsf_render* call.
+// Pre-allocate a maximum number of voices that can play simultaneously by
+// calling tsf_set_max_voices after loading (and the channels, see below) so
+// no memory gets allocated while rendering.
 //
 // 2. Channels:
 //
@@ -164,13 +250,39 @@ TSFDEF void tsf_set_volume(tsf* f, float global_gain);
 //   (tsf_set_max_voices returns 0 if allocation failed, otherwise 1)
 TSFDEF int tsf_set_max_voices(tsf* f, int max_voices);
 
+// Select the interpolation used by the voice render methods (default is TSF_INTERPOLATION_LINEAR)
+// Higher quality modes reduce the aliasing of notes played far above the pitch of their sample.
+//   (tsf_set_interpolation returns 0 if allocation of the sinc table failed, otherwise 1)
+TSFDEF int tsf_set_interpolation(tsf* f, enum TSFInterpolation interpolation);
+
+// Set the level below which releasing voices are ended early instead of rendering inaudible tails
+// Held voices are never ended this way because channel volume changes can make them louder again.
+//   threshold_db: level in decibels relative to full scale (for example -96.0), 0 or above disables it (the default)
+TSFDEF void tsf_set_silence_threshold(tsf* f, float threshold_db);
+
+// Select which voice is taken over when a note starts while no free voice is left (default is TSF_STEAL_RELEASED)
+// Voices in their release are taken before held voices with every policy except TSF_STEAL_CHANNEL_PRIORITY
+// where the channel priority is compared first.
+TSFDEF void tsf_set_voice_stealing(tsf* f, enum TSFVoiceSteal policy);
+
+// Limit the number of voices to what can be rendered within a share of the real time duration of each buffer
+// The average render cost per voice is measured by tsf_render_float, tsf_render_float_events and tsf_render_short,
+// and from tsf_render_parallel_begin to tsf_render_parallel_end (the elapsed time of all workers together, so adding
+// worker threads raises the number of voices that fit). When more voices are playing than fit into
+// the budget, the ones picked by the voice stealing policy are faded out quickly and new notes take over voices.
+// If the policy finds no voice to take over (like TSF_STEAL_RELEASED without releasing voices), new notes take
+// over the quietest voice instead of getting dropped.
+//   clock: returns the current time in seconds (a monotonic high resolution timer), TSF_NULL disables the limit
+//   max_load: share of the buffer duration voice rendering may use (for example 0.5 for 50%)
+TSFDEF void tsf_set_render_budget(tsf* f, double (*clock)(void), float max_load);
+
 // Start playing a note
 //   preset_index: preset index >= 0 and < tsf_get_presetcount()
 //   key: note value between 0 and 127 (60 being middle C)
 //   vel: velocity as a float between 0.0 (equal to note off) and 1.0 (full)
 //   bank: instrument bank number (alternative to preset_index)
 //   preset_number: preset number (alternative to preset_index)
-//   (tsf_note_on returns 0 if the allocation of a new voice failed, otherwise 1)
+//   (tsf_note_on returns 0 if the allocation of a new voice failed or the event queue is full, otherwise 1)
 //   (tsf_bank_note_on returns 0 if preset does not exist or allocation failed, otherwise 1)
 TSFDEF int tsf_note_on(tsf* f, int preset_index, int key, float vel);
 TSFDEF int tsf_bank_note_on(tsf* f, int bank, int preset_number, int key, float vel);
@@ -186,6 +298,22 @@ TSFDEF void tsf_note_off_all(tsf* f);
 // Returns the number of active voices
 TSFDEF int tsf_active_voice_count(tsf* f);
 
+// Read the samples of a preset of a SoundFont loaded with tsf_load_filename_lazy if they are not in memory yet
+// Otherwise this happens on the first note or preset selection using the preset. Call this ahead of time (for example
+// when a song is loaded) to avoid file reads during playback. It can also be called on the handle of tsf_create_queue
+// (or any other tsf_copy instance) to read the samples outside of the render thread.
+//   preset_index: preset index >= 0 and < tsf_get_presetcount()
+// Unlike reading on a note or preset selection, this waits while another thread is reading from the file.
+//   (tsf_preload_preset returns 0 if allocation or reading failed, otherwise 1 also for fonts that are not lazily loaded)
+TSFDEF int tsf_preload_preset(tsf* f, int preset_index);
+
+// Limit the memory used by the samples of a lazily loaded SoundFont
+// When reading the samples of a preset would exceed the limit, the samples of the least recently used presets
+// which are not playing are freed first. Samples are only freed while no copies of the tsf instance exist
+// (including the handle of tsf_create_queue), so a lazily loaded font shared by several instances only grows.
+//   max_bytes: memory limit in bytes, 0 for no limit (the default)
+TSFDEF void tsf_set_max_sample_memory(tsf* f, size_t max_bytes);
+
 // Render output samples into a buffer
 // You can either render as signed 16-bit values (tsf_render_short) or
 // as 32-bit float values (tsf_render_float)
@@ -195,6 +323,79 @@ TSFDEF int tsf_active_voice_count(tsf* f);
 TSFDEF void tsf_render_short(tsf* f, short* buffer, int samples, int flag_mixing CPP_DEFAULT0);
 TSFDEF void tsf_render_float(tsf* f, float* buffer, int samples, int flag_mixing CPP_DEFAULT0);
 
+// Event types for tsf_render_float_events, each calls the matching function with the listed event fields
+enum TSFEventType
+{
+	TSF_EVENT_NOTE_ON,                // tsf_note_on(param1 preset_index, param2 key, value vel)
+	TSF_EVENT_NOTE_OFF,               // tsf_note_off(param1 preset_index, param2 key)
+	TSF_EVENT_NOTE_OFF_ALL,           // tsf_note_off_all()
+	TSF_EVENT_RESET,                  // tsf_reset()
+	TSF_EVENT_CHANNEL_PRESETINDEX,    // tsf_channel_set_presetindex(channel, param1 preset_index)
+	TSF_EVENT_CHANNEL_PRESETNUMBER,   // tsf_channel_set_presetnumber(channel, param1 preset_number, param2 flag_mididrums)
+	TSF_EVENT_CHANNEL_BANK,           // tsf_channel_set_bank(channel, param1 bank)
+	TSF_EVENT_CHANNEL_BANK_PRESET,    // tsf_channel_set_bank_preset(channel, param1 bank, param2 preset_number)
+	TSF_EVENT_CHANNEL_PAN,            // tsf_channel_set_pan(channel, value pan)
+	TSF_EVENT_CHANNEL_VOLUME,         // tsf_channel_set_volume(channel, value volume)
+	TSF_EVENT_CHANNEL_PITCHWHEEL,     // tsf_channel_set_pitchwheel(channel, param1 pitch_wheel)
+	TSF_EVENT_CHANNEL_PITCHRANGE,     // tsf_channel_set_pitchrange(channel, value pitch_range)
+	TSF_EVENT_CHANNEL_TUNING,         // tsf_channel_set_tuning(channel, value tuning)
+	TSF_EVENT_CHANNEL_SUSTAIN,        // tsf_channel_set_sustain(channel, param1 flag_sustain)
+	TSF_EVENT_CHANNEL_NOTE_ON,        // tsf_channel_note_on(channel, param1 key, value vel)
+	TSF_EVENT_CHANNEL_NOTE_OFF,       // tsf_channel_note_off(channel, param1 key)
+	TSF_EVENT_CHANNEL_NOTE_OFF_ALL,   // tsf_channel_note_off_all(channel)
+	TSF_EVENT_CHANNEL_SOUNDS_OFF_ALL, // tsf_channel_sounds_off_all(channel)
+	TSF_EVENT_CHANNEL_MIDI_CONTROL,   // tsf_channel_midi_control(channel, param1 controller, param2 control_value)
+	TSF_EVENT_CHANNEL_PRIORITY        // tsf_channel_set_priority(channel, param1 priority)
+};
+
+struct tsf_event
+{
+	int offset; // sample position in the rendered buffer at which the event is applied
+	int type; // TSFEventType
+	int channel, param1, param2;
+	float value;
+};
+
+// Render output samples into a buffer while applying events at exact sample positions
+// This allows rendering large buffers without the timing of the events being limited to the buffer size
+//   events: array of events sorted by offset (events with an offset >= samples are applied at the end)
+//   event_count: number of events in the array
+TSFDEF void tsf_render_float_events(tsf* f, float* buffer, int samples, const struct tsf_event* events, int event_count, int flag_mixing CPP_DEFAULT0);
+
+// Render output samples with multiple threads, the voices get distributed among the calling threads
+// 1. call tsf_render_parallel_begin on the thread that owns the tsf instance
+// 2. call tsf_render_parallel_worker on any number of threads at the same time, each with its own buffer
+// 3. once all workers have returned, call tsf_render_parallel_end to sum up the worker buffers
+// No other function may be called on the tsf instance between begin and end.
+//   worker_buffer: buffer of size samples * output_channels * sizeof(float) for each worker
+//   worker_buffers: array of the buffers of all workers that have been used with tsf_render_parallel_worker
+TSFDEF void tsf_render_parallel_begin(tsf* f);
+TSFDEF void tsf_render_parallel_worker(tsf* f, float* worker_buffer, int samples);
+TSFDEF void tsf_render_parallel_end(tsf* f, float* buffer, float* const* worker_buffers, int worker_count, int samples, int flag_mixing CPP_DEFAULT0);
+
+// Scheduler to render many independent tsf instances (i.e. created with tsf_copy) with multiple threads
+// 1. call tsf_scheduler_begin at the start of each period
+// 2. call tsf_scheduler_worker on any number of threads at the same time to render all instances
+// 3. the worker call that finishes the last instance returns 1, all buffers are then filled
+//   instances: array of tsf instances to render each period
+//   buffers: output buffer for each instance (of size samples * output_channels * sizeof(float))
+//   clock: optional function returning the current time in seconds to measure render times and overruns
+//   deadline: time in seconds after tsf_scheduler_begin until which each instance should be rendered
+//   (tsf_scheduler_create returns TSF_NULL if allocation failed)
+typedef struct tsf_scheduler tsf_scheduler;
+TSFDEF tsf_scheduler* tsf_scheduler_create(tsf* const* instances, float* const* buffers, int instance_count, double (*clock)(void));
+TSFDEF void tsf_scheduler_close(tsf_scheduler* s);
+TSFDEF void tsf_scheduler_begin(tsf_scheduler* s, int samples, double deadline);
+TSFDEF int tsf_scheduler_worker(tsf_scheduler* s);
+
+// Get statistics of an instance in the scheduler
+//   instance_index: index into the instances passed to tsf_scheduler_create
+//   (render time and finish time relative to tsf_scheduler_begin of the last period in seconds,
+//    overruns is the number of periods in which the instance finished after the deadline)
+TSFDEF double tsf_scheduler_get_rendertime(const tsf_scheduler* s, int instance_index);
+TSFDEF double tsf_scheduler_get_finishtime(const tsf_scheduler* s, int instance_index);
+TSFDEF int tsf_scheduler_get_overruns(const tsf_scheduler* s, int instance_index);
+
 // Higher level channel based functions, set up channel parameters
 //   channel: channel number
 //   preset_index: preset index >= 0 and < tsf_get_presetcount()
@@ -207,8 +408,9 @@ TSFDEF void tsf_render_float(tsf* f, float* buffer, int samples, int flag_mixing
 //   pitch_range: range of the pitch wheel in semitones (default 2.0, total +/- 2 semitones)
 //   tuning: tuning of all playing voices in semitones (default 0.0, standard (A440) tuning)
 //   flag_sustain: 0 to end notes that were held sustained and disable holding sustain otherwise enable it
+//   priority: voices of channels with lower values get taken over first with TSF_STEAL_CHANNEL_PRIORITY (default 0)
 //   (tsf_set_preset_number and set_bank_preset return 0 if preset does not exist, otherwise 1)
-//   (tsf_channel_set_... return 0 if a new channel needed allocation and that failed, otherwise 1)
+//   (tsf_channel_set_... return 0 if a new channel needed allocation and that failed or the event queue is full, otherwise 1)
 TSFDEF int tsf_channel_set_presetindex(tsf* f, int channel, int preset_index);
 TSFDEF int tsf_channel_set_presetnumber(tsf* f, int channel, int preset_number, int flag_mididrums CPP_DEFAULT0);
 TSFDEF int tsf_channel_set_bank(tsf* f, int channel, int bank);
@@ -219,6 +421,7 @@ TSFDEF int tsf_channel_set_pitchwheel(tsf* f, int channel, int pitch_wheel);
 TSFDEF int tsf_channel_set_pitchrange(tsf* f, int channel, float pitch_range);
 TSFDEF int tsf_channel_set_tuning(tsf* f, int channel, float tuning);
 TSFDEF int tsf_channel_set_sustain(tsf* f, int channel, int flag_sustain);
+TSFDEF int tsf_channel_set_priority(tsf* f, int channel, int priority);
 
 // Start or stop playing notes on a channel (needs channel preset to be set)
 //   channel: channel number
@@ -243,6 +446,7 @@ TSFDEF float tsf_channel_get_volume(tsf* f, int channel);
 TSFDEF int tsf_channel_get_pitchwheel(tsf* f, int channel);
 TSFDEF float tsf_channel_get_pitchrange(tsf* f, int channel);
 TSFDEF float tsf_channel_get_tuning(tsf* f, int channel);
+TSFDEF int tsf_channel_get_priority(tsf* f, int channel);
 
 #ifdef __cplusplus
 #  undef CPP_DEFAULT0
@@ -287,7 +491,7 @@ TSFDEF float tsf_channel_get_tuning(tsf* f, int channel);
 #  define TSF_MEMSET  memset
 #endif
 
-#if !defined(TSF_POW) || !defined(TSF_POWF) || !defined(TSF_EXPF) || !defined(TSF_LOG) || !defined(TSF_TAN) || !defined(TSF_LOG10) || !defined(TSF_SQRT)
+#if !defined(TSF_POW) || !defined(TSF_POWF) || !defined(TSF_EXPF) || !defined(TSF_LOG) || !defined(TSF_TAN) || !defined(TSF_COS) || !defined(TSF_LOG10) || !defined(TSF_SQRT)
 #  include <math.h>
 #  if !defined(__cplusplus) && !defined(NAN) && !defined(powf) && !defined(expf) && !defined(sqrtf)
 #    define powf (float)pow // deal with old math.h
@@ -299,6 +503,7 @@ TSFDEF float tsf_channel_get_tuning(tsf* f, int channel);
 #  define TSF_EXPF    expf
 #  define TSF_LOG     log
 #  define TSF_TAN     tan
+#  define TSF_COS     cos
 #  define TSF_LOG10   log10
 #  define TSF_SQRTF   sqrtf
 #endif
@@ -307,6 +512,66 @@ TSFDEF float tsf_channel_get_tuning(tsf* f, int channel);
 #  include <stdio.h>
 #endif
 
+#if !defined(TSF_NO_MMAP) && (defined(_WIN32) || defined(__unix__) || defined(__APPLE__))
+#  define TSF_MMAP
+#  ifdef _WIN32
+#    include <windows.h>
+#  else
+#    include <sys/mman.h>
+#    include <sys/stat.h>
+#    include <fcntl.h>
+#    include <unistd.h>
+#  endif
+#endif
+
+// Select the SIMD instruction set used by the voice rendering at compile time
+// (the plain C code path is always used for the remainder of each block and serves as reference)
+#ifndef TSF_NO_SIMD
+#  if defined(__SSE2__) || defined(_M_X64) || defined(_M_AMD64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#    define TSF_SIMD_SSE2
+#    include <emmintrin.h>
+#    if defined(__AVX2__)
+#      define TSF_SIMD_AVX2
+#      include <immintrin.h>
+#    endif
+#  elif defined(__ARM_NEON) || defined(__ARM_NEON__) || defined(_M_ARM64)
+#    define TSF_SIMD_NEON
+#    include <arm_neon.h>
+#    if defined(__aarch64__) || defined(_M_ARM64)
+#      define TSF_SIMD_NEON64
+#    endif
+#  endif
+#endif
+
+// Force inlining of the voice render stages into the specialized block kernels
+#if !defined(TSF_FORCEINLINE)
+#  if defined(_MSC_VER)
+#    define TSF_FORCEINLINE __forceinline
+#  elif defined(__GNUC__) || defined(__clang__)
+#    define TSF_FORCEINLINE __inline__ __attribute__((always_inline))
+#  else
+#    define TSF_FORCEINLINE
+#  endif
+#endif
+
+// Atomic operations with acquire/release ordering for the event queue and parallel rendering
+#if !defined(TSF_ATOMIC_LOAD) || !defined(TSF_ATOMIC_STORE) || !defined(TSF_ATOMIC_ADD)
+#  if defined(__GNUC__) || defined(__clang__)
+#    define TSF_ATOMIC_LOAD(p) __atomic_load_n(p, __ATOMIC_ACQUIRE)
+#    define TSF_ATOMIC_STORE(p, v) __atomic_store_n(p, v, __ATOMIC_RELEASE)
+#    define TSF_ATOMIC_ADD(p, v) __atomic_fetch_add(p, v, __ATOMIC_ACQ_REL)
+#  elif defined(_MSC_VER)
+#    include <intrin.h>
+#    define TSF_ATOMIC_LOAD(p) (unsigned int)_InterlockedOr((volatile long*)(p), 0)
+#    define TSF_ATOMIC_STORE(p, v) _InterlockedExchange((volatile long*)(p), (long)(v))
+#    define TSF_ATOMIC_ADD(p, v) _InterlockedExchangeAdd((volatile long*)(p), (long)(v))
+#  else
+#    define TSF_ATOMIC_LOAD(p) (*(volatile unsigned int*)(p))
+#    define TSF_ATOMIC_STORE(p, v) (*(volatile unsigned int*)(p) = (v))
+#    define TSF_ATOMIC_ADD(p, v) ((*(volatile unsigned int*)(p) += (v)) - (v)) // not atomic, define TSF_ATOMIC_* for multi-threaded use
+#  endif
+#endif
+
 #define TSF_TRUE 1
 #define TSF_FALSE 0
 #define TSF_BOOL unsigned char
@@ -323,32 +588,118 @@ typedef unsigned char tsf_u8;
 typedef unsigned short tsf_u16;
 typedef signed short tsf_s16;
 typedef unsigned int tsf_u32;
+typedef unsigned long long tsf_u64;
 typedef char tsf_char20[20];
 
+#ifdef TSF_FIXEDPOINT_PHASE
+// Sample playback position with a 32-bit integer part and a 32-bit fraction
+typedef tsf_u64 tsf_phase;
+#define TSF_PHASE_FROM_INDEX(index) ((tsf_u64)(index) << 32)
+#define TSF_PHASE_FROM_RATIO(ratio) ((tsf_u64)((ratio) * 4294967296.0))
+#define TSF_PHASE_INDEX(phase) ((unsigned int)((phase) >> 32))
+#define TSF_PHASE_FRACTION(phase) ((float)(int)((tsf_u32)(phase) >> 8) * (1.0f / 16777216.0f))
+#else
+typedef double tsf_phase;
+#define TSF_PHASE_FROM_INDEX(index) ((double)(index))
+#define TSF_PHASE_FROM_RATIO(ratio) (ratio)
+#define TSF_PHASE_INDEX(phase) ((unsigned int)(phase))
+#define TSF_PHASE_FRACTION(phase) ((float)((phase) - (unsigned int)(phase)))
+#endif
+
+// Number of fractional positions in the windowed sinc table, each row has 8 filter coefficients
+#define TSF_SINC_PHASES 256
+
+#ifdef TSF_SAMPLES_SHORT
+// Samples are kept as 16-bit integers and only get scaled down to float range by the voice gain
+typedef tsf_s16 tsf_sample;
+#define TSF_SAMPLE_GAIN (1.0f / 32767.0f)
+#define TSF_SAMPLE_FROM_SHORT(value) (value)
+#define TSF_SAMPLE_FROM_FLOAT(value) (tsf_s16)((value) < -1.0f ? -32767 : ((value) > 1.0f ? 32767 : (int)((value) * 32767.0f)))
+#else
+typedef float tsf_sample;
+#define TSF_SAMPLE_GAIN 1.0f
+#define TSF_SAMPLE_FROM_SHORT(value) (float)((value) / 32767.0)
+#define TSF_SAMPLE_FROM_FLOAT(value) (value)
+#endif
+
 #define TSF_FourCCEquals(value1, value2) (value1[0] == value2[0] && value1[1] == value2[1] && value1[2] == value2[2] && value1[3] == value2[3])
 
-struct tsf
+// Loaded SoundFont data which is shared by all tsf instances created with tsf_copy and never modified after loading
+// (except for reading and freeing the samples of presets of a lazily loaded SoundFont)
+struct tsf_font
 {
 	struct tsf_preset* presets;
-	float* fontSamples;
+	struct tsf_region* regions; // one allocation holding the regions of all presets followed by the preset table and the key indices
+	tsf_sample* samples;
+	void* mapping;
+	unsigned int mappingSize;
+	int presetNum;
+	unsigned int refCount; // number of tsf instances using the font, modified atomically
+	void* lazyFile; // FILE of tsf_load_filename_lazy from which presets read their samples (NULL if all samples are loaded)
+	tsf_u64 lazySmplPos; // file position of the smpl chunk data
+	unsigned int smplCount, lastUse;
+	unsigned int lazyLock; // guards the preset samples, residentBytes and maxResidentBytes while publishing or freeing samples
+	unsigned int lazyFileLock; // guards the position of lazyFile while reading
+	unsigned int lazyTrackUse; // set while maxResidentBytes is set, lastUse of the presets only gets updated then
+	size_t residentBytes, maxResidentBytes;
+	struct tsf_allocator allocator; // all function pointers are NULL when using TSF_MALLOC, TSF_REALLOC and TSF_FREE
+};
+
+struct tsf
+{
+	struct tsf_font* font;
 	struct tsf_voice* voices;
+	int* activeVoices;
 	struct tsf_channels* channels;
+	struct tsf_queue* queueSend; // set on a handle returned by tsf_create_queue
+	struct tsf_queue* queueReceive; // set on the instance that applies the queued events
 
-	int presetNum;
 	int voiceNum;
 	int maxVoiceNum;
+	int activeVoiceNum;
+	int voiceFreeHead;
+	unsigned int renderNextVoice; // next entry in activeVoices to be taken by a parallel render worker
+	int renderParallel;
+	double renderParallelStart; // clock time of tsf_render_parallel_begin for the render budget
 	unsigned int voicePlayIndex;
 
 	enum TSFOutputMode outputmode;
+	enum TSFInterpolation interpolation;
+	enum TSFVoiceSteal voiceSteal;
+	float* sincTable; // (TSF_SINC_PHASES + 2) rows of coefficients, allocated by tsf_set_interpolation
 	float outSampleRate;
 	float globalGainDB;
-	int* refCount;
+	float silenceGain; // releasing voices quieter than this get ended (0 if disabled)
+
+	double (*renderClock)(void); // set by tsf_set_render_budget to measure the voice render cost
+	double voiceSampleCost; // running average of the seconds spent rendering one sample of one voice
+	float renderMaxLoad;
+	int renderVoiceLimit; // number of voices that fit into the render budget (0 if unlimited)
 };
 
+static void* tsf_alloc(const struct tsf_allocator* a, size_t size) { return (a->allocate ? a->allocate(a->data, size) : TSF_MALLOC(size)); }
+static void* tsf_realloc(const struct tsf_allocator* a, void* ptr, size_t size) { return (a->reallocate ? a->reallocate(a->data, ptr, size) : TSF_REALLOC(ptr, size)); }
+static void tsf_free(const struct tsf_allocator* a, void* ptr) { if (!a->deallocate) TSF_FREE(ptr); else if (ptr) a->deallocate(a->data, ptr); }
+
+struct tsf_stream_memory { const char* buffer; unsigned int total, pos; };
+static tsf* tsf_load_ex(struct tsf_stream* stream, const struct tsf_stream_memory* memory, TSF_BOOL isMapping, const struct tsf_allocator* allocator, void* lazyFile);
+
 #ifndef TSF_NO_STDIO
 static int tsf_stream_stdio_read(FILE* f, void* ptr, unsigned int size) { return (int)fread(ptr, 1, size, f); }
-static int tsf_stream_stdio_skip(FILE* f, unsigned int count) { return !fseek(f, count, SEEK_CUR); }
-TSFDEF tsf* tsf_load_filename(const char* filename)
+// Absolute file positions are 64-bit, a seek which the platform's offset type can't represent fails instead of wrapping around
+// (32-bit POSIX systems need _FILE_OFFSET_BITS defined to 64 before including stdio.h to access files larger than 2 GB)
+#if defined(_WIN32)
+static int tsf_file_seek(FILE* f, tsf_u64 pos) { return _fseeki64(f, (__int64)pos, SEEK_SET); }
+static tsf_u64 tsf_file_tell(FILE* f) { return (tsf_u64)_ftelli64(f); }
+#elif defined(__APPLE__) || (defined(_POSIX_C_SOURCE) && _POSIX_C_SOURCE >= 200112L) || (defined(_XOPEN_SOURCE) && _XOPEN_SOURCE >= 500) || defined(_LARGEFILE_SOURCE)
+static int tsf_file_seek(FILE* f, tsf_u64 pos) { return ((tsf_u64)(off_t)pos != pos || (off_t)pos < 0 ? -1 : fseeko(f, (off_t)pos, SEEK_SET)); }
+static tsf_u64 tsf_file_tell(FILE* f) { return (tsf_u64)ftello(f); }
+#else
+static int tsf_file_seek(FILE* f, tsf_u64 pos) { return ((tsf_u64)(long)pos != pos || (long)pos < 0 ? -1 : fseek(f, (long)pos, SEEK_SET)); }
+static tsf_u64 tsf_file_tell(FILE* f) { return (tsf_u64)ftell(f); }
+#endif
+static int tsf_stream_stdio_skip(FILE* f, unsigned int count) { return !tsf_file_seek(f, tsf_file_tell(f) + count); }
+static tsf* tsf_load_filename_ex(const char* filename, TSF_BOOL lazy)
 {
 	tsf* res;
 	struct tsf_stream stream = { TSF_NULL, (int(*)(void*,void*,unsigned int))&tsf_stream_stdio_read, (int(*)(void*,unsigned int))&tsf_stream_stdio_skip };
@@ -363,13 +714,14 @@ TSFDEF tsf* tsf_load_filename(const char* filename)
 		return TSF_NULL;
 	}
 	stream.data = f;
-	res = tsf_load(&stream);
-	fclose(f);
+	res = tsf_load_ex(&stream, TSF_NULL, TSF_FALSE, TSF_NULL, (lazy ? f : TSF_NULL));
+	if (!res || !res->font->lazyFile) fclose(f);
 	return res;
 }
+TSFDEF tsf* tsf_load_filename(const char* filename) { return tsf_load_filename_ex(filename, TSF_FALSE); }
+TSFDEF tsf* tsf_load_filename_lazy(const char* filename) { return tsf_load_filename_ex(filename, TSF_TRUE); }
 #endif
 
-struct tsf_stream_memory { const char* buffer; unsigned int total, pos; };
 static int tsf_stream_memory_read(struct tsf_stream_memory* m, void* ptr, unsigned int size) { if (size > m->total - m->pos) size = m->total - m->pos; TSF_MEMCPY(ptr, m->buffer+m->pos, size); m->pos += size; return size; }
 static int tsf_stream_memory_skip(struct tsf_stream_memory* m, unsigned int count) { if (m->pos + count > m->total) return 0; m->pos += count; return 1; }
 TSFDEF tsf* tsf_load_memory(const void* buffer, int size)
@@ -379,8 +731,68 @@ TSFDEF tsf* tsf_load_memory(const void* buffer, int size)
 	f.buffer = (const char*)buffer;
 	f.total = size;
 	stream.data = &f;
-	return tsf_load(&stream);
+	return tsf_load_ex(&stream, &f, TSF_FALSE, TSF_NULL, TSF_NULL);
+}
+
+#ifdef TSF_MMAP
+static void tsf_unmap(void* data, unsigned int size)
+{
+	#ifdef _WIN32
+	(void)size;
+	UnmapViewOfFile(data);
+	#else
+	munmap(data, size);
+	#endif
+}
+#endif
+
+#ifndef TSF_NO_MMAP
+TSFDEF tsf* tsf_load_mmap(const char* filename)
+{
+	#ifdef TSF_MMAP
+	tsf* res;
+	struct tsf_stream stream = { TSF_NULL, (int(*)(void*,void*,unsigned int))&tsf_stream_memory_read, (int(*)(void*,unsigned int))&tsf_stream_memory_skip };
+	struct tsf_stream_memory f = { 0, 0, 0 };
+	#ifdef _WIN32
+	LARGE_INTEGER fileSize;
+	HANDLE hMap, hFile = CreateFileA(filename, GENERIC_READ, FILE_SHARE_READ, TSF_NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, TSF_NULL);
+	if (hFile == INVALID_HANDLE_VALUE) return TSF_NULL;
+	if (!GetFileSizeEx(hFile, &fileSize) || fileSize.QuadPart <= 0 || fileSize.QuadPart > 0xFFFFFFFF || !(hMap = CreateFileMappingA(hFile, TSF_NULL, PAGE_READONLY, 0, 0, TSF_NULL)))
+	{
+		CloseHandle(hFile);
+		return TSF_NULL;
+	}
+	f.buffer = (const char*)MapViewOfFile(hMap, FILE_MAP_READ, 0, 0, 0);
+	f.total = (unsigned int)fileSize.QuadPart;
+	CloseHandle(hMap); // the mapped view keeps the file open
+	CloseHandle(hFile);
+	if (!f.buffer) return TSF_NULL;
+	#else
+	struct stat fileStat;
+	void* view;
+	int fd = open(filename, O_RDONLY);
+	if (fd < 0) return TSF_NULL;
+	if (fstat(fd, &fileStat) || fileStat.st_size <= 0 || (unsigned long long)fileStat.st_size > 0xFFFFFFFF || (view = mmap(TSF_NULL, (size_t)fileStat.st_size, PROT_READ, MAP_SHARED, fd, 0)) == MAP_FAILED)
+	{
+		close(fd);
+		return TSF_NULL;
+	}
+	close(fd); // the mapping keeps the file open
+	f.buffer = (const char*)view;
+	f.total = (unsigned int)fileStat.st_size;
+	#endif
+	stream.data = &f;
+	res = tsf_load_ex(&stream, &f, TSF_TRUE, TSF_NULL, TSF_NULL);
+	if (!res || !res->font->mapping) tsf_unmap((void*)f.buffer, f.total); // samples were not used from the mapping
+	return res;
+	#elif !defined(TSF_NO_STDIO)
+	return tsf_load_filename(filename);
+	#else
+	(void)filename;
+	return TSF_NULL;
+	#endif
 }
+#endif
 
 enum { TSF_LOOPMODE_NONE, TSF_LOOPMODE_CONTINUOUS, TSF_LOOPMODE_SUSTAIN };
 
@@ -405,17 +817,26 @@ struct tsf_hydra_imod { tsf_u16 modSrcOper, modDestOper; tsf_s16 modAmount; tsf_
 struct tsf_hydra_igen { tsf_u16 genOper; union tsf_hydra_genamount genAmount; };
 struct tsf_hydra_shdr { tsf_char20 sampleName; tsf_u32 start, end, startLoop, endLoop, sampleRate; tsf_u8 originalPitch; tsf_s8 pitchCorrection; tsf_u16 sampleLink, sampleType; };
 
-#define TSFR(FIELD) stream->read(stream->data, &i->FIELD, sizeof(i->FIELD));
-static void tsf_hydra_read_phdr(struct tsf_hydra_phdr* i, struct tsf_stream* stream) { TSFR(presetName) TSFR(preset) TSFR(bank) TSFR(presetBagNdx) TSFR(library) TSFR(genre) TSFR(morphology) }
-static void tsf_hydra_read_pbag(struct tsf_hydra_pbag* i, struct tsf_stream* stream) { TSFR(genNdx) TSFR(modNdx) }
-static void tsf_hydra_read_pmod(struct tsf_hydra_pmod* i, struct tsf_stream* stream) { TSFR(modSrcOper) TSFR(modDestOper) TSFR(modAmount) TSFR(modAmtSrcOper) TSFR(modTransOper) }
-static void tsf_hydra_read_pgen(struct tsf_hydra_pgen* i, struct tsf_stream* stream) { TSFR(genOper) TSFR(genAmount) }
-static void tsf_hydra_read_inst(struct tsf_hydra_inst* i, struct tsf_stream* stream) { TSFR(instName) TSFR(instBagNdx) }
-static void tsf_hydra_read_ibag(struct tsf_hydra_ibag* i, struct tsf_stream* stream) { TSFR(instGenNdx) TSFR(instModNdx) }
-static void tsf_hydra_read_imod(struct tsf_hydra_imod* i, struct tsf_stream* stream) { TSFR(modSrcOper) TSFR(modDestOper) TSFR(modAmount) TSFR(modAmtSrcOper) TSFR(modTransOper) }
-static void tsf_hydra_read_igen(struct tsf_hydra_igen* i, struct tsf_stream* stream) { TSFR(genOper) TSFR(genAmount) }
-static void tsf_hydra_read_shdr(struct tsf_hydra_shdr* i, struct tsf_stream* stream) { TSFR(sampleName) TSFR(start) TSFR(end) TSFR(startLoop) TSFR(endLoop) TSFR(sampleRate) TSFR(originalPitch) TSFR(pitchCorrection) TSFR(sampleLink) TSFR(sampleType) }
-#undef TSFR
+// Little endian field decoding from the raw chunk data independent of the host byte order and alignment
+#define TSFR16(OFS) (tsf_u16)(p[OFS] | (p[OFS + 1] << 8))
+#define TSFR32(OFS) ((tsf_u32)p[OFS] | ((tsf_u32)p[OFS + 1] << 8) | ((tsf_u32)p[OFS + 2] << 16) | ((tsf_u32)p[OFS + 3] << 24))
+static void tsf_hydra_decode_genamount(union tsf_hydra_genamount* a, tsf_u16 genOper, const tsf_u8* p)
+{
+	// Key and velocity ranges are two bytes, all other amounts are 16-bit words
+	if (genOper == 43 || genOper == 44) { a->range.lo = p[0]; a->range.hi = p[1]; }
+	else a->wordAmount = TSFR16(0);
+}
+static void tsf_hydra_decode_phdr(struct tsf_hydra_phdr* i, const tsf_u8* p) { TSF_MEMCPY(i->presetName, p, 20); i->preset = TSFR16(20); i->bank = TSFR16(22); i->presetBagNdx = TSFR16(24); i->library = TSFR32(26); i->genre = TSFR32(30); i->morphology = TSFR32(34); }
+static void tsf_hydra_decode_pbag(struct tsf_hydra_pbag* i, const tsf_u8* p) { i->genNdx = TSFR16(0); i->modNdx = TSFR16(2); }
+static void tsf_hydra_decode_pmod(struct tsf_hydra_pmod* i, const tsf_u8* p) { i->modSrcOper = TSFR16(0); i->modDestOper = TSFR16(2); i->modAmount = (tsf_s16)TSFR16(4); i->modAmtSrcOper = TSFR16(6); i->modTransOper = TSFR16(8); }
+static void tsf_hydra_decode_pgen(struct tsf_hydra_pgen* i, const tsf_u8* p) { i->genOper = TSFR16(0); tsf_hydra_decode_genamount(&i->genAmount, i->genOper, p + 2); }
+static void tsf_hydra_decode_inst(struct tsf_hydra_inst* i, const tsf_u8* p) { TSF_MEMCPY(i->instName, p, 20); i->instBagNdx = TSFR16(20); }
+static void tsf_hydra_decode_ibag(struct tsf_hydra_ibag* i, const tsf_u8* p) { i->instGenNdx = TSFR16(0); i->instModNdx = TSFR16(2); }
+static void tsf_hydra_decode_imod(struct tsf_hydra_imod* i, const tsf_u8* p) { i->modSrcOper = TSFR16(0); i->modDestOper = TSFR16(2); i->modAmount = (tsf_s16)TSFR16(4); i->modAmtSrcOper = TSFR16(6); i->modTransOper = TSFR16(8); }
+static void tsf_hydra_decode_igen(struct tsf_hydra_igen* i, const tsf_u8* p) { i->genOper = TSFR16(0); tsf_hydra_decode_genamount(&i->genAmount, i->genOper, p + 2); }
+static void tsf_hydra_decode_shdr(struct tsf_hydra_shdr* i, const tsf_u8* p) { TSF_MEMCPY(i->sampleName, p, 20); i->start = TSFR32(20); i->end = TSFR32(24); i->startLoop = TSFR32(28); i->endLoop = TSFR32(32); i->sampleRate = TSFR32(36); i->originalPitch = p[40]; i->pitchCorrection = (tsf_s8)p[41]; i->sampleLink = TSFR16(42); i->sampleType = TSFR16(44); }
+#undef TSFR16
+#undef TSFR32
 
 struct tsf_riffchunk { tsf_fourcc id; tsf_u32 size; };
 struct tsf_envelope { float delay, attack, hold, decay, sustain, release, keynumToHold, keynumToDecay; };
@@ -438,6 +859,12 @@ struct tsf_region
 	int freqModLFO, modLfoToPitch;
 	float delayVibLFO;
 	int freqVibLFO, vibLfoToPitch;
+
+	// Note-on invariants precomputed at load time, independent of the output sample rate
+	double pitchOutputRate; // sample_rate / 2^(pitch_keycenter/12), divided by the output rate gives the voice pitchOutputFactor
+	double lowpassQInv;
+	float lowpassFcHertz; // cutoff of initialFilterFc in Hz
+	float modLfoRate, vibLfoRate; // 4 times the LFO frequency, the triangle wave moves by 4 units per period
 };
 
 struct tsf_preset
@@ -446,6 +873,11 @@ struct tsf_preset
 	tsf_u16 preset, bank;
 	struct tsf_region* regions;
 	int regionNum;
+	int* keyRegions; // 129 offsets into this array, the regions playing key k are listed from [keyRegions[k]] to [keyRegions[k+1]]
+	tsf_sample* samples; // sample data the region positions refer to (NULL while the samples of a lazily loaded preset are not read)
+	unsigned int resident; // set atomically once samples of a lazily loaded preset can be used
+	tsf_u64 sampleOffset; // first font sample used by a lazily loaded preset, its file position is lazySmplPos + sampleOffset * 2
+	unsigned int sampleNum, lastUse;
 };
 
 struct tsf_voice
@@ -453,9 +885,12 @@ struct tsf_voice
 	int playingPreset, playingKey, playingChannel, heldSustain;
 	struct tsf_region* region;
 	double pitchInputTimecents, pitchOutputFactor;
-	double sourceSamplePosition;
+	tsf_phase sourceSamplePosition;
 	float  noteGainDB, panFactorLeft, panFactorRight;
 	unsigned int playIndex, loopStart, loopEnd;
+	int nextFree; // index of the next voice in the free list while not playing
+	int activeIndex; // position in the active voice list while playing
+	int keyChannel, keyPrev, keyNext; // channel key list this voice is linked into (or -1) and its neighbors
 	struct tsf_voice_envelope ampenv, modenv;
 	struct tsf_voice_lowpass lowpass;
 	struct tsf_voice_lfo modlfo, viblfo;
@@ -465,6 +900,8 @@ struct tsf_channel
 {
 	unsigned short presetIndex, bank, pitchWheel, midiPan, midiVolume, midiExpression, midiRPN, midiData : 14, sustain : 1;
 	float panOffset, gainDB, pitchRange, tuning;
+	int priority;
+	int keyVoices[128]; // first voice of each key, linked in start order (keyPrev of the first voice is the last)
 };
 
 struct tsf_channels
@@ -474,10 +911,61 @@ struct tsf_channels
 	struct tsf_channel channels[1];
 };
 
+struct tsf_queue
+{
+	// Single producer single consumer ring buffer, writePos is only written by the sending thread
+	// and readPos only by the rendering thread (kept apart to avoid sharing a cache line)
+	unsigned int writePos;
+	char padding[60];
+	unsigned int readPos, mask;
+	struct tsf_event events[1];
+};
+
+#ifdef TSF_FAST_MATH
+static double tsf_exp2(double x)
+{
+	// Split x into a power of two and a remainder in [-0.5,0.5], 2^remainder is a degree 7 Taylor polynomial (relative error below 1e-8)
+	union { double d; tsf_u64 i; } scale;
+	double n, r;
+	if (x < -1022.0) return 0.0;
+	if (x > 1023.0) x = 1023.0;
+	n = (double)(int)(x < 0 ? x - 0.5 : x + 0.5);
+	r = (x - n) * 0.69314718055994530942;
+	scale.i = (tsf_u64)((int)n + 1023) << 52;
+	return scale.d * (1.0 + r * (1.0 + r * (1.0/2 + r * (1.0/6 + r * (1.0/24 + r * (1.0/120 + r * (1.0/720 + r * (1.0/5040))))))));
+}
+
+static double tsf_sin_quadrant(double x)
+{
+	// Taylor polynomial up to x^13 for x in [0,pi/2] (error below 1e-9)
+	double xx = x * x;
+	return x * (1.0 - xx * (1.0/6 - xx * (1.0/120 - xx * (1.0/5040 - xx * (1.0/362880 - xx * (1.0/39916800 - xx * (1.0/6227020800.0)))))));
+}
+
+static double tsf_tan_pi(double Fc)
+{
+	// tan(pi*Fc) for Fc in [0,0.5) with the cosine taken as the sine of the complement to keep the relative error small near pi/2
+	return tsf_sin_quadrant(TSF_PI * Fc) / tsf_sin_quadrant(TSF_PI * (0.5 - Fc));
+}
+
+static float tsf_powi(float x, int n)
+{
+	// Integer powers by squaring (in double to keep the rounding from adding up), enough for the per block envelope slopes
+	double res = 1.0, y = x;
+	for (; n; n >>= 1, y *= y) if (n & 1) res *= y;
+	return (float)res;
+}
+
+static double tsf_timecents2Secsd(double timecents) { return tsf_exp2(timecents / 1200.0); }
+static float tsf_timecents2Secsf(float timecents) { return (float)tsf_exp2(timecents / 1200.0f); }
+static float tsf_cents2Hertz(float cents) { return 8.176f * (float)tsf_exp2(cents / 1200.0f); }
+static float tsf_decibelsToGain(float db) { return (db > -100.f ? (float)tsf_exp2(db * 0.16609640474436811) : 0); } // 10^(db/20) = 2^(db*log2(10)/20)
+#else
 static double tsf_timecents2Secsd(double timecents) { return TSF_POW(2.0, timecents / 1200.0); }
 static float tsf_timecents2Secsf(float timecents) { return TSF_POWF(2.0f, timecents / 1200.0f); }
 static float tsf_cents2Hertz(float cents) { return 8.176f * TSF_POWF(2.0f, cents / 1200.0f); }
 static float tsf_decibelsToGain(float db) { return (db > -100.f ? TSF_POWF(10.0f, db * 0.05f) : 0); }
+#endif
 static float tsf_gainToDecibels(float gain) { return (gain <= .00001f ? -100.f : (float)(20.0 * TSF_LOG10(gain))); }
 
 static TSF_BOOL tsf_riffchunk_read(struct tsf_riffchunk* parent, struct tsf_riffchunk* chunk, struct tsf_stream* stream)
@@ -496,6 +984,28 @@ static TSF_BOOL tsf_riffchunk_read(struct tsf_riffchunk* parent, struct tsf_riff
 	return TSF_TRUE;
 }
 
+static const tsf_u8* tsf_hydra_chunk_data(const struct tsf_riffchunk* chunk, struct tsf_stream* stream, const struct tsf_stream_memory* memory, tsf_u8** buffer, unsigned int* bufferSize, const struct tsf_allocator* a)
+{
+	// Memory and mapped sources are parsed in place, otherwise the chunk is read into a buffer reused for all chunks
+	int got;
+	if (memory && chunk->size <= memory->total - memory->pos)
+	{
+		const tsf_u8* data = (const tsf_u8*)memory->buffer + memory->pos;
+		stream->skip(stream->data, chunk->size);
+		return data;
+	}
+	if (!*buffer || chunk->size > *bufferSize)
+	{
+		tsf_free(a, *buffer);
+		*bufferSize = (chunk->size ? chunk->size : 1);
+		if (!(*buffer = (tsf_u8*)tsf_alloc(a, *bufferSize))) return TSF_NULL;
+	}
+	got = stream->read(stream->data, *buffer, chunk->size);
+	if (got < 0) got = 0;
+	if ((unsigned int)got < chunk->size) TSF_MEMSET(*buffer + got, 0, chunk->size - got); // truncated file
+	return *buffer;
+}
+
 static void tsf_region_clear(struct tsf_region* i, TSF_BOOL for_relative)
 {
 	TSF_MEMSET(i, 0, sizeof(struct tsf_region));
@@ -705,76 +1215,138 @@ static void tsf_region_envtosecs(struct tsf_envelope* p, TSF_BOOL sustainIsGain)
 	else p->sustain = 1.0f - (p->sustain / 1000.0f);
 }
 
-static int tsf_load_presets(tsf* res, struct tsf_hydra *hydra, unsigned int fontSampleCount)
+static int tsf_load_preset_keyregions(struct tsf_preset* preset, int* keyRegions)
 {
-	enum { GenInstrument = 41, GenKeyRange = 43, GenVelRange = 44, GenSampleID = 53 };
-	// Read each preset.
-	struct tsf_hydra_phdr *pphdr, *pphdrMax;
-	res->presetNum = hydra->phdrNum - 1;
-	res->presets = (struct tsf_preset*)TSF_MALLOC(res->presetNum * sizeof(struct tsf_preset));
-	if (!res->presets) return 0;
-	else { int i; for (i = 0; i != res->presetNum; i++) res->presets[i].regions = TSF_NULL; }
-	for (pphdr = hydra->phdrs, pphdrMax = pphdr + hydra->phdrNum - 1; pphdr != pphdrMax; pphdr++)
+	// Build an index of the regions for each key to avoid testing all regions in tsf_note_on, returns the number of ints used
+	int keyOffsets[129], key, total = 0;
+	struct tsf_region *region, *regionEnd = preset->regions + preset->regionNum;
+	for (key = 0; key != 129; key++) keyOffsets[key] = 0;
+	for (region = preset->regions; region != regionEnd; region++)
+		for (key = region->lokey; key <= region->hikey && key < 128; key++, total++)
+			keyOffsets[key + 1]++;
+	preset->keyRegions = keyRegions;
+	for (keyOffsets[0] = 129, key = 0; key != 128; key++) keyOffsets[key + 1] += keyOffsets[key];
+	TSF_MEMCPY(preset->keyRegions, keyOffsets, sizeof(keyOffsets));
+	for (region = preset->regions; region != regionEnd; region++)
+		for (key = region->lokey; key <= region->hikey && key < 128; key++)
+			preset->keyRegions[keyOffsets[key]++] = (int)(region - preset->regions);
+	return 129 + total;
+}
+
+static void tsf_sort_keys(tsf_u64* keys, tsf_u64* tmp, int num)
+{
+	// Bottom up merge sort alternating between the two buffers, the result ends up in keys
+	tsf_u64 *src = keys, *dst = tmp, *swap;
+	int width, i;
+	for (width = 1; width < num; width *= 2, swap = src, src = dst, dst = swap)
 	{
-		int sortedIndex = 0, region_index = 0;
-		struct tsf_hydra_phdr *otherphdr;
-		struct tsf_preset* preset;
-		struct tsf_hydra_pbag *ppbag, *ppbagEnd;
-		struct tsf_region globalRegion;
-		for (otherphdr = hydra->phdrs; otherphdr != pphdrMax; otherphdr++)
+		for (i = 0; i < num; i += 2 * width)
 		{
-			if (otherphdr == pphdr || otherphdr->bank > pphdr->bank) continue;
-			else if (otherphdr->bank < pphdr->bank) sortedIndex++;
-			else if (otherphdr->preset > pphdr->preset) continue;
-			else if (otherphdr->preset < pphdr->preset) sortedIndex++;
-			else if (otherphdr < pphdr) sortedIndex++;
+			int a = i, mid = (i + width < num ? i + width : num), b = mid, end = (i + 2 * width < num ? i + 2 * width : num), o = i;
+			while (a < mid && b < end) dst[o++] = (src[b] < src[a] ? src[b++] : src[a++]);
+			while (a < mid) dst[o++] = src[a++];
+			while (b < end) dst[o++] = src[b++];
 		}
+	}
+	if (src != keys) TSF_MEMCPY(keys, src, num * sizeof(tsf_u64));
+}
 
-		preset = &res->presets[sortedIndex];
-		TSF_MEMCPY(preset->presetName, pphdr->presetName, sizeof(preset->presetName));
-		preset->presetName[sizeof(preset->presetName)-1] = '\0'; //should be zero terminated in source file but make sure
-		preset->bank = pphdr->bank;
-		preset->preset = pphdr->preset;
-		preset->regionNum = 0;
+// Instrument zone with all instrument generators applied, resolved once per instrument and shared by all presets using it
+struct tsf_hydra_zone { struct tsf_region region; tsf_u16 sampleID; };
 
-		//count regions covered by this preset
-		for (ppbag = hydra->pbags + pphdr->presetBagNdx, ppbagEnd = hydra->pbags + pphdr[1].presetBagNdx; ppbag != ppbagEnd; ppbag++)
+static struct tsf_hydra_zone* tsf_load_instrument_zones(struct tsf_hydra *hydra, int* zoneStart, const struct tsf_allocator* a)
+{
+	// Fills zoneStart[0] to zoneStart[instNum] with the range of zones of each instrument (the terminal record has none)
+	enum { GenSampleID = 53 };
+	struct tsf_hydra_zone* zones;
+	struct tsf_hydra_inst *pinst, *pinstEnd = hydra->insts + (hydra->instNum ? hydra->instNum - 1 : 0);
+	struct tsf_hydra_ibag *pibag, *pibagEnd;
+	struct tsf_hydra_igen *pigen, *pigenEnd;
+	int zoneNum = 0, i;
+	for (pinst = hydra->insts; pinst != pinstEnd; pinst++)
+		for (pibag = hydra->ibags + pinst->instBagNdx, pibagEnd = hydra->ibags + pinst[1].instBagNdx; pibag != pibagEnd; pibag++)
+			for (pigen = hydra->igens + pibag->instGenNdx, pigenEnd = hydra->igens + pibag[1].instGenNdx; pigen != pigenEnd; pigen++)
+				if (pigen->genOper == GenSampleID && pigen->genAmount.wordAmount < hydra->shdrNum) zoneNum++;
+	zones = (struct tsf_hydra_zone*)tsf_alloc(a, (zoneNum ? zoneNum : 1) * sizeof(struct tsf_hydra_zone));
+	if (!zones) return TSF_NULL;
+
+	for (zoneNum = 0, pinst = hydra->insts; pinst != pinstEnd; pinst++)
+	{
+		struct tsf_region instRegion;
+		zoneStart[pinst - hydra->insts] = zoneNum;
+		tsf_region_clear(&instRegion, TSF_FALSE);
+		for (pibag = hydra->ibags + pinst->instBagNdx, pibagEnd = hydra->ibags + pinst[1].instBagNdx; pibag != pibagEnd; pibag++)
 		{
-			unsigned char plokey = 0, phikey = 127, plovel = 0, phivel = 127;
-			struct tsf_hydra_pgen *ppgen, *ppgenEnd; struct tsf_hydra_inst *pinst; struct tsf_hydra_ibag *pibag, *pibagEnd; struct tsf_hydra_igen *pigen, *pigenEnd;
-			for (ppgen = hydra->pgens + ppbag->genNdx, ppgenEnd = hydra->pgens + ppbag[1].genNdx; ppgen != ppgenEnd; ppgen++)
+			// Generators.
+			struct tsf_region zoneRegion = instRegion;
+			int hadSampleID = 0;
+			for (pigen = hydra->igens + pibag->instGenNdx, pigenEnd = hydra->igens + pibag[1].instGenNdx; pigen != pigenEnd; pigen++)
 			{
-				if (ppgen->genOper == GenKeyRange) { plokey = ppgen->genAmount.range.lo; phikey = ppgen->genAmount.range.hi; continue; }
-				if (ppgen->genOper == GenVelRange) { plovel = ppgen->genAmount.range.lo; phivel = ppgen->genAmount.range.hi; continue; }
-				if (ppgen->genOper != GenInstrument) continue;
-				if (ppgen->genAmount.wordAmount >= hydra->instNum) continue;
-				pinst = hydra->insts + ppgen->genAmount.wordAmount;
-				for (pibag = hydra->ibags + pinst->instBagNdx, pibagEnd = hydra->ibags + pinst[1].instBagNdx; pibag != pibagEnd; pibag++)
+				if (pigen->genOper != GenSampleID) tsf_region_operator(&zoneRegion, pigen->genOper, &pigen->genAmount, TSF_NULL);
+				else if (pigen->genAmount.wordAmount < hydra->shdrNum)
 				{
-					unsigned char ilokey = 0, ihikey = 127, ilovel = 0, ihivel = 127;
-					for (pigen = hydra->igens + pibag->instGenNdx, pigenEnd = hydra->igens + pibag[1].instGenNdx; pigen != pigenEnd; pigen++)
-					{
-						if (pigen->genOper == GenKeyRange) { ilokey = pigen->genAmount.range.lo; ihikey = pigen->genAmount.range.hi; continue; }
-						if (pigen->genOper == GenVelRange) { ilovel = pigen->genAmount.range.lo; ihivel = pigen->genAmount.range.hi; continue; }
-						if (pigen->genOper == GenSampleID && ihikey >= plokey && ilokey <= phikey && ihivel >= plovel && ilovel <= phivel) preset->regionNum++;
-					}
+					zones[zoneNum].region = zoneRegion;
+					zones[zoneNum].sampleID = pigen->genAmount.wordAmount;
+					zoneNum++;
+					hadSampleID = 1;
 				}
 			}
-		}
 
-		preset->regions = (struct tsf_region*)TSF_MALLOC(preset->regionNum * sizeof(struct tsf_region));
-		if (!preset->regions)
-		{
-			int i; for (i = 0; i != res->presetNum; i++) TSF_FREE(res->presets[i].regions);
-			TSF_FREE(res->presets);
-			return 0;
+			// Handle instrument's global zone.
+			if (pibag == hydra->ibags + pinst->instBagNdx && !hadSampleID)
+				instRegion = zoneRegion;
+
+			// Modulators (TODO)
+			//if (ibag->instModNdx < ibag[1].instModNdx) addUnsupportedOpcode("any modulator");
 		}
+	}
+	for (i = (int)(pinstEnd - hydra->insts); i <= hydra->instNum; i++) zoneStart[i] = zoneNum;
+	return zones;
+}
+
+static int tsf_load_presets(struct tsf_font* res, struct tsf_hydra *hydra, unsigned int fontSampleCount)
+{
+	enum { GenInstrument = 41 };
+	const struct tsf_allocator* a = &res->allocator;
+	int sortedIndex, regionNum = 0, regionCapacity = 0, keyRegionNum = 0, *zoneStart, *keyRegion;
+	tsf_u64* sortKeys;
+	struct tsf_hydra_zone* zones = TSF_NULL;
+	struct tsf_region* regions = TSF_NULL;
+	struct tsf_preset* presets;
+	res->presetNum = hydra->phdrNum - 1;
+	presets = (struct tsf_preset*)tsf_alloc(a, (res->presetNum > 0 ? res->presetNum : 1) * sizeof(struct tsf_preset));
+	if (!presets) return 0;
+
+	// Sort the presets by bank, preset number and file order once (key bits 32 to 63 hold bank and preset, 0 to 31 the index)
+	// and resolve every instrument's zones once, the zone start offsets are kept after the sorting buffers
+	sortKeys = (tsf_u64*)tsf_alloc(a, (res->presetNum > 0 ? res->presetNum : 1) * 2 * sizeof(tsf_u64) + (hydra->instNum + 1) * sizeof(int));
+	if (!sortKeys) goto out_of_memory;
+	zoneStart = (int*)(sortKeys + (res->presetNum > 0 ? res->presetNum : 1) * 2);
+	if (!(zones = tsf_load_instrument_zones(hydra, zoneStart, a))) goto out_of_memory;
+	for (sortedIndex = 0; sortedIndex < res->presetNum; sortedIndex++)
+		sortKeys[sortedIndex] = ((tsf_u64)hydra->phdrs[sortedIndex].bank << 48) | ((tsf_u64)hydra->phdrs[sortedIndex].preset << 32) | (tsf_u64)sortedIndex;
+	tsf_sort_keys(sortKeys, sortKeys + (res->presetNum > 0 ? res->presetNum : 0), res->presetNum);
+
+	// Read each preset in sorted order, all regions are appended to one array shared by all presets.
+	for (sortedIndex = 0; sortedIndex < res->presetNum; sortedIndex++)
+	{
+		struct tsf_hydra_phdr *pphdr = hydra->phdrs + (tsf_u32)sortKeys[sortedIndex];
+		struct tsf_preset* preset;
+		struct tsf_hydra_pbag *ppbag, *ppbagEnd;
+		struct tsf_region globalRegion;
+
+		preset = &presets[sortedIndex];
+		TSF_MEMCPY(preset->presetName, pphdr->presetName, sizeof(preset->presetName));
+		preset->presetName[sizeof(preset->presetName)-1] = '\0'; //should be zero terminated in source file but make sure
+		preset->bank = pphdr->bank;
+		preset->preset = pphdr->preset;
+		preset->regionNum = regionNum; // start offset until all regions are loaded
 		tsf_region_clear(&globalRegion, TSF_TRUE);
 
 		// Zones.
 		for (ppbag = hydra->pbags + pphdr->presetBagNdx, ppbagEnd = hydra->pbags + pphdr[1].presetBagNdx; ppbag != ppbagEnd; ppbag++)
 		{
-			struct tsf_hydra_pgen *ppgen, *ppgenEnd; struct tsf_hydra_inst *pinst; struct tsf_hydra_ibag *pibag, *pibagEnd; struct tsf_hydra_igen *pigen, *pigenEnd;
+			struct tsf_hydra_pgen *ppgen, *ppgenEnd;
 			struct tsf_region presetRegion = globalRegion;
 			int hadGenInstrument = 0;
 
@@ -784,69 +1356,65 @@ static int tsf_load_presets(tsf* res, struct tsf_hydra *hydra, unsigned int font
 				// Instrument.
 				if (ppgen->genOper == GenInstrument)
 				{
-					struct tsf_region instRegion;
+					struct tsf_hydra_zone *zone, *zoneEnd;
 					tsf_u16 whichInst = ppgen->genAmount.wordAmount;
 					if (whichInst >= hydra->instNum) continue;
 
-					tsf_region_clear(&instRegion, TSF_FALSE);
-					pinst = &hydra->insts[whichInst];
-					for (pibag = hydra->ibags + pinst->instBagNdx, pibagEnd = hydra->ibags + pinst[1].instBagNdx; pibag != pibagEnd; pibag++)
+					for (zone = zones + zoneStart[whichInst], zoneEnd = zones + zoneStart[whichInst + 1]; zone != zoneEnd; zone++)
 					{
-						// Generators.
-						struct tsf_region zoneRegion = instRegion;
-						int hadSampleID = 0;
-						for (pigen = hydra->igens + pibag->instGenNdx, pigenEnd = hydra->igens + pibag[1].instGenNdx; pigen != pigenEnd; pigen++)
+						struct tsf_region zoneRegion = zone->region;
+						struct tsf_hydra_shdr* pshdr;
+
+						//preset region key and vel ranges are a filter for the zone regions
+						if (zoneRegion.hikey < presetRegion.lokey || zoneRegion.lokey > presetRegion.hikey) continue;
+						if (zoneRegion.hivel < presetRegion.lovel || zoneRegion.lovel > presetRegion.hivel) continue;
+						if (presetRegion.lokey > zoneRegion.lokey) zoneRegion.lokey = presetRegion.lokey;
+						if (presetRegion.hikey < zoneRegion.hikey) zoneRegion.hikey = presetRegion.hikey;
+						if (presetRegion.lovel > zoneRegion.lovel) zoneRegion.lovel = presetRegion.lovel;
+						if (presetRegion.hivel < zoneRegion.hivel) zoneRegion.hivel = presetRegion.hivel;
+
+						//sum regions
+						tsf_region_operator(&zoneRegion, 0, TSF_NULL, &presetRegion);
+
+						// EG times need to be converted from timecents to seconds.
+						tsf_region_envtosecs(&zoneRegion.ampenv, TSF_TRUE);
+						tsf_region_envtosecs(&zoneRegion.modenv, TSF_FALSE);
+
+						// LFO times need to be converted from timecents to seconds.
+						zoneRegion.delayModLFO = (zoneRegion.delayModLFO < -11950.0f ? 0.0f : tsf_timecents2Secsf(zoneRegion.delayModLFO));
+						zoneRegion.delayVibLFO = (zoneRegion.delayVibLFO < -11950.0f ? 0.0f : tsf_timecents2Secsf(zoneRegion.delayVibLFO));
+
+						// Fixup sample positions
+						pshdr = &hydra->shdrs[zone->sampleID];
+						zoneRegion.offset += pshdr->start;
+						zoneRegion.end += pshdr->end;
+						zoneRegion.loop_start += pshdr->startLoop;
+						zoneRegion.loop_end += pshdr->endLoop;
+						if (pshdr->endLoop > 0) zoneRegion.loop_end -= 1;
+						if (zoneRegion.loop_end > fontSampleCount) zoneRegion.loop_end = fontSampleCount;
+						if (zoneRegion.pitch_keycenter == -1) zoneRegion.pitch_keycenter = pshdr->originalPitch;
+						zoneRegion.tune += pshdr->pitchCorrection;
+						zoneRegion.sample_rate = pshdr->sampleRate;
+						if (zoneRegion.end && zoneRegion.end < fontSampleCount) zoneRegion.end++;
+						else zoneRegion.end = fontSampleCount;
+
+						// Precompute the values needed by every note-on which only the output rate still scales
+						zoneRegion.pitchOutputRate = zoneRegion.sample_rate / tsf_timecents2Secsd(zoneRegion.pitch_keycenter * 100.0);
+						zoneRegion.lowpassQInv = 1.0 / TSF_POW(10.0, (zoneRegion.initialFilterQ / 10.0f) / 20.0);
+						zoneRegion.lowpassFcHertz = tsf_cents2Hertz((float)zoneRegion.initialFilterFc);
+						zoneRegion.modLfoRate = 4.0f * tsf_cents2Hertz((float)zoneRegion.freqModLFO);
+						zoneRegion.vibLfoRate = 4.0f * tsf_cents2Hertz((float)zoneRegion.freqVibLFO);
+
+						if (regionNum == regionCapacity)
 						{
-							if (pigen->genOper == GenSampleID)
-							{
-								struct tsf_hydra_shdr* pshdr;
-
-								//preset region key and vel ranges are a filter for the zone regions
-								if (zoneRegion.hikey < presetRegion.lokey || zoneRegion.lokey > presetRegion.hikey) continue;
-								if (zoneRegion.hivel < presetRegion.lovel || zoneRegion.lovel > presetRegion.hivel) continue;
-								if (presetRegion.lokey > zoneRegion.lokey) zoneRegion.lokey = presetRegion.lokey;
-								if (presetRegion.hikey < zoneRegion.hikey) zoneRegion.hikey = presetRegion.hikey;
-								if (presetRegion.lovel > zoneRegion.lovel) zoneRegion.lovel = presetRegion.lovel;
-								if (presetRegion.hivel < zoneRegion.hivel) zoneRegion.hivel = presetRegion.hivel;
-
-								//sum regions
-								tsf_region_operator(&zoneRegion, 0, TSF_NULL, &presetRegion);
-
-								// EG times need to be converted from timecents to seconds.
-								tsf_region_envtosecs(&zoneRegion.ampenv, TSF_TRUE);
-								tsf_region_envtosecs(&zoneRegion.modenv, TSF_FALSE);
-
-								// LFO times need to be converted from timecents to seconds.
-								zoneRegion.delayModLFO = (zoneRegion.delayModLFO < -11950.0f ? 0.0f : tsf_timecents2Secsf(zoneRegion.delayModLFO));
-								zoneRegion.delayVibLFO = (zoneRegion.delayVibLFO < -11950.0f ? 0.0f : tsf_timecents2Secsf(zoneRegion.delayVibLFO));
-
-								// Fixup sample positions
-								pshdr = &hydra->shdrs[pigen->genAmount.wordAmount];
-								zoneRegion.offset += pshdr->start;
-								zoneRegion.end += pshdr->end;
-								zoneRegion.loop_start += pshdr->startLoop;
-								zoneRegion.loop_end += pshdr->endLoop;
-								if (pshdr->endLoop > 0) zoneRegion.loop_end -= 1;
-								if (zoneRegion.loop_end > fontSampleCount) zoneRegion.loop_end = fontSampleCount;
-								if (zoneRegion.pitch_keycenter == -1) zoneRegion.pitch_keycenter = pshdr->originalPitch;
-								zoneRegion.tune += pshdr->pitchCorrection;
-								zoneRegion.sample_rate = pshdr->sampleRate;
-								if (zoneRegion.end && zoneRegion.end < fontSampleCount) zoneRegion.end++;
-								else zoneRegion.end = fontSampleCount;
-
-								preset->regions[region_index] = zoneRegion;
-								region_index++;
-								hadSampleID = 1;
-							}
-							else tsf_region_operator(&zoneRegion, pigen->genOper, &pigen->genAmount, TSF_NULL);
+							// Grow the shared region array geometrically
+							struct tsf_region* newRegions = (struct tsf_region*)tsf_realloc(a, regions, (regionCapacity ? regionCapacity * 2 : 64) * sizeof(struct tsf_region));
+							if (!newRegions) goto out_of_memory;
+							regions = newRegions;
+							regionCapacity = (regionCapacity ? regionCapacity * 2 : 64);
 						}
-
-						// Handle instrument's global zone.
-						if (pibag == hydra->ibags + pinst->instBagNdx && !hadSampleID)
-							instRegion = zoneRegion;
-
-						// Modulators (TODO)
-						//if (ibag->instModNdx < ibag[1].instModNdx) addUnsupportedOpcode("any modulator");
+						regions[regionNum++] = zoneRegion;
+						if (zoneRegion.lokey < 128 && zoneRegion.lokey <= zoneRegion.hikey) keyRegionNum += (zoneRegion.hikey < 128 ? zoneRegion.hikey : 127) - zoneRegion.lokey + 1; // same keys as tsf_load_preset_keyregions
 					}
 					hadGenInstrument = 1;
 				}
@@ -860,14 +1428,170 @@ static int tsf_load_presets(tsf* res, struct tsf_hydra *hydra, unsigned int font
 			if (ppbag == hydra->pbags + pphdr->presetBagNdx && !hadGenInstrument)
 				globalRegion = presetRegion;
 		}
+		keyRegionNum += 129;
+	}
+
+	// Move the regions and the preset table into one block followed by the key indices built for each preset
+	res->regions = (struct tsf_region*)tsf_alloc(a, regionNum * sizeof(struct tsf_region) + (res->presetNum > 0 ? res->presetNum : 0) * sizeof(struct tsf_preset) + keyRegionNum * sizeof(int) + 1);
+	if (!res->regions) goto out_of_memory;
+	res->presets = (struct tsf_preset*)(res->regions + regionNum);
+	if (regionNum) TSF_MEMCPY(res->regions, regions, regionNum * sizeof(struct tsf_region));
+	if (res->presetNum > 0) TSF_MEMCPY(res->presets, presets, res->presetNum * sizeof(struct tsf_preset));
+	for (keyRegion = (int*)(res->presets + (res->presetNum > 0 ? res->presetNum : 0)), sortedIndex = 0; sortedIndex < res->presetNum; sortedIndex++)
+	{
+		struct tsf_preset* preset = &res->presets[sortedIndex];
+		int regionEnd = (sortedIndex + 1 < res->presetNum ? presets[sortedIndex + 1].regionNum : regionNum);
+		preset->regions = res->regions + preset->regionNum;
+		preset->regionNum = regionEnd - preset->regionNum;
+		keyRegion += tsf_load_preset_keyregions(preset, keyRegion);
+	}
+	tsf_free(a, zones);
+	tsf_free(a, sortKeys);
+	tsf_free(a, regions);
+	tsf_free(a, presets);
+	return 1;
+
+out_of_memory:
+	tsf_free(a, zones);
+	tsf_free(a, sortKeys);
+	tsf_free(a, regions);
+	tsf_free(a, presets);
+	return 0;
+}
+
+// Give every preset the sample data its regions refer to. With lazy loading each preset gets the range of samples
+// used by its regions (with a few guard samples before the start for the interpolation taps) and its regions are
+// rebased to the start of that range, the samples are read by tsf_load_preset_samples when they are first needed.
+static void tsf_load_lazy_spans(struct tsf_font* font)
+{
+	enum { GuardSamples = 8 };
+	struct tsf_preset *preset, *presetEnd;
+	for (preset = font->presets, presetEnd = preset + font->presetNum; preset != presetEnd; preset++)
+	{
+		struct tsf_region *region, *regionEnd = preset->regions + preset->regionNum;
+		unsigned int spanStart = (unsigned int)-1, spanEnd = 0;
+		if (!font->lazyFile) { preset->samples = font->samples; continue; }
+		for (region = preset->regions; region != regionEnd; region++)
+		{
+			TSF_BOOL doLoop = (region->loop_mode != TSF_LOOPMODE_NONE && region->loop_start < region->loop_end);
+			unsigned int start = (region->offset < region->end ? region->offset : region->end);
+			unsigned int end = (doLoop && region->loop_end >= region->end ? region->loop_end + 1 : region->end) + 1;
+			if (doLoop && region->loop_start < start) start = region->loop_start;
+			if (start < spanStart) spanStart = start;
+			if (end > spanEnd) spanEnd = end;
+		}
+		if (spanStart > spanEnd) spanStart = spanEnd = 0; // no regions
+		spanStart = (spanStart > GuardSamples ? spanStart - GuardSamples : 0);
+		for (region = preset->regions; region != regionEnd; region++)
+		{
+			region->offset -= spanStart;
+			region->end -= spanStart;
+			if (region->loop_mode == TSF_LOOPMODE_NONE || region->loop_start >= region->loop_end) continue;
+			region->loop_start -= spanStart;
+			region->loop_end -= spanStart;
+		}
+		preset->samples = TSF_NULL;
+		preset->resident = preset->lastUse = 0;
+		preset->sampleOffset = spanStart;
+		preset->sampleNum = spanEnd - spanStart;
+	}
+}
+
+#ifndef TSF_NO_STDIO
+// Spin locks for the lazy loading state of a font, the fetch-and-add returns 0 only for the thread that acquires it,
+// the others undo their increment and fail or retry
+static int tsf_lazy_trylock(unsigned int* lock) { if (!TSF_ATOMIC_ADD(lock, 1)) return 1; TSF_ATOMIC_ADD(lock, (unsigned int)-1); return 0; }
+static void tsf_lazy_lock(unsigned int* lock) { while (!tsf_lazy_trylock(lock)) {} }
+static void tsf_lazy_unlock(unsigned int* lock) { TSF_ATOMIC_ADD(lock, (unsigned int)-1); }
+
+// Free the samples of the least recently used presets until needed more bytes fit into the memory limit,
+// only possible while no other tsf instance shares the font and for presets not playing on this instance
+// (called with the state lock held)
+static void tsf_evict_preset_samples(tsf* f, size_t needed)
+{
+	struct tsf_font* font = f->font;
+	if (!font->maxResidentBytes || TSF_ATOMIC_LOAD(&font->refCount) != 1) return;
+	while (font->residentBytes + needed > font->maxResidentBytes)
+	{
+		struct tsf_preset *preset, *presetEnd, *oldest = TSF_NULL;
+		unsigned int oldestUse = 0;
+		int *active, *activeEnd;
+		for (preset = font->presets, presetEnd = preset + font->presetNum; preset != presetEnd; preset++)
+		{
+			unsigned int lastUse = TSF_ATOMIC_LOAD(&preset->lastUse);
+			if (!preset->resident || (oldest && lastUse - oldestUse < 0x80000000u)) continue;
+			for (active = f->activeVoices, activeEnd = active + f->activeVoiceNum; active != activeEnd; active++)
+				if (f->voices[*active].playingPreset == (int)(preset - font->presets)) break;
+			if (active == activeEnd) oldest = preset, oldestUse = lastUse;
+		}
+		if (!oldest) return;
+		TSF_ATOMIC_STORE(&oldest->resident, 0);
+		tsf_free(&font->allocator, oldest->samples);
+		oldest->samples = TSF_NULL;
+		font->residentBytes -= oldest->sampleNum * sizeof(tsf_sample);
 	}
+}
+
+// Read the range of samples used by a lazily loaded preset from the file into a new buffer and publish it
+// The file lock is held until the samples are published, the state lock only to make room and to publish. Without wait, the
+// read fails if another thread is reading from the file at the same time instead of waiting for it.
+static int tsf_load_preset_samples(tsf* f, struct tsf_preset* preset, TSF_BOOL wait)
+{
+	struct tsf_font* font = f->font;
+	size_t size = preset->sampleNum * sizeof(tsf_sample);
+	unsigned int readNum = (preset->sampleOffset < font->smplCount ? font->smplCount - (unsigned int)preset->sampleOffset : 0);
+	tsf_sample* samples;
+	if (readNum > preset->sampleNum) readNum = preset->sampleNum;
+	if (wait) tsf_lazy_lock(&font->lazyFileLock);
+	else if (!tsf_lazy_trylock(&font->lazyFileLock)) return 0;
+	if (TSF_ATOMIC_LOAD(&preset->resident)) { tsf_lazy_unlock(&font->lazyFileLock); return 1; } // read by another thread meanwhile
+
+	tsf_lazy_lock(&font->lazyLock);
+	tsf_evict_preset_samples(f, size);
+	tsf_lazy_unlock(&font->lazyLock);
+	samples = (tsf_sample*)tsf_alloc(&font->allocator, size);
+	if (!samples || (readNum && (tsf_file_seek((FILE*)font->lazyFile, font->lazySmplPos + preset->sampleOffset * sizeof(short))
+		|| fread(samples, sizeof(short), readNum, (FILE*)font->lazyFile) != readNum)))
+	{
+		tsf_lazy_unlock(&font->lazyFileLock);
+		tsf_free(&font->allocator, samples);
+		return 0;
+	}
+	#ifndef TSF_SAMPLES_SHORT
+	{
+		// Inline convert the samples from short to float
+		float *out = samples + readNum; const short *in = (short*)samples + readNum;
+		while (out != samples) *(--out) = TSF_SAMPLE_FROM_SHORT(*(--in));
+	}
+	#endif
+	if (readNum != preset->sampleNum) TSF_MEMSET(samples + readNum, 0, (preset->sampleNum - readNum) * sizeof(tsf_sample));
+
+	tsf_lazy_lock(&font->lazyLock);
+	preset->samples = samples;
+	font->residentBytes += size;
+	TSF_ATOMIC_STORE(&preset->resident, 1);
+	tsf_lazy_unlock(&font->lazyLock);
+	tsf_lazy_unlock(&font->lazyFileLock); // released after publishing so the next reader of this preset sees it as resident
 	return 1;
 }
 
+// Make sure the samples of a preset are in memory, the resident flag is checked without taking any lock
+static int tsf_lazy_preset_ready(tsf* f, int preset_index, TSF_BOOL wait)
+{
+	struct tsf_font* font = f->font;
+	struct tsf_preset* preset = &font->presets[preset_index];
+	if (TSF_ATOMIC_LOAD(&font->lazyTrackUse)) TSF_ATOMIC_STORE(&preset->lastUse, TSF_ATOMIC_ADD(&font->lastUse, 1) + 1); // only needed to pick the presets to free
+	if (!preset->sampleNum || TSF_ATOMIC_LOAD(&preset->resident)) return 1;
+	return tsf_load_preset_samples(f, preset, wait);
+}
+#else
+static int tsf_lazy_preset_ready(tsf* f, int preset_index, TSF_BOOL wait) { (void)f; (void)preset_index; (void)wait; return 1; }
+#endif
+
 #ifdef STB_VORBIS_INCLUDE_STB_VORBIS_H
-static int tsf_decode_ogg(const tsf_u8 *pSmpl, const tsf_u8 *pSmplEnd, float** pRes, tsf_u32* pResNum, tsf_u32* pResMax, tsf_u32 resInitial)
+static int tsf_decode_ogg(const tsf_u8 *pSmpl, const tsf_u8 *pSmplEnd, tsf_sample** pRes, tsf_u32* pResNum, tsf_u32* pResMax, tsf_u32 resInitial, const struct tsf_allocator* a)
 {
-	float *res = *pRes, *oldres; tsf_u32 resNum = *pResNum; tsf_u32 resMax = *pResMax; stb_vorbis *v;
+	tsf_sample *res = *pRes, *oldres; tsf_u32 resNum = *pResNum; tsf_u32 resMax = *pResMax; stb_vorbis *v;
 
 	// Use whatever stb_vorbis API that is available (either pull or push)
 	#if !defined(STB_VORBIS_NO_PULLDATA_API) && !defined(STB_VORBIS_NO_FROMMEMORY)
@@ -897,21 +1621,25 @@ static int tsf_decode_ogg(const tsf_u8 *pSmpl, const tsf_u8 *pSmplEnd, float** p
 		{
 			do { resMax += (resMax ? (resMax < 1048576 ? resMax : 1048576) : resInitial); } while (resNum > resMax);
 			oldres = res;
-			res = (float*)TSF_REALLOC(res, resMax * sizeof(float));
-			if (!res) { TSF_FREE(oldres); stb_vorbis_close(v); return 0; }
+			res = (tsf_sample*)tsf_realloc(a, res, resMax * sizeof(tsf_sample));
+			if (!res) { tsf_free(a, oldres); stb_vorbis_close(v); return 0; }
 		}
+		#ifdef TSF_SAMPLES_SHORT
+		{ const float *in = outputs[0], *inEnd = in + n_samples; tsf_sample* out = res + resNum - n_samples; for (; in != inEnd; in++) *(out++) = TSF_SAMPLE_FROM_FLOAT(*in); }
+		#else
 		TSF_MEMCPY(res + resNum - n_samples, outputs[0], n_samples * sizeof(float));
+		#endif
 	}
 	stb_vorbis_close(v);
 	*pRes = res; *pResNum = resNum; *pResMax = resMax;
 	return 1;
 }
 
-static int tsf_decode_sf3_samples(const void* rawBuffer, float** pFloatBuffer, unsigned int* pSmplCount, struct tsf_hydra *hydra)
+static int tsf_decode_sf3_samples(const void* rawBuffer, tsf_sample** pSampleBuffer, unsigned int* pSmplCount, struct tsf_hydra *hydra, const struct tsf_allocator* a)
 {
 	const tsf_u8* smplBuffer = (const tsf_u8*)rawBuffer;
 	tsf_u32 smplLength = *pSmplCount, resNum = 0, resMax = 0, resInitial = (smplLength > 0x100000 ? (smplLength & ~0xFFFFF) : 65536);
-	float *res = TSF_NULL, *oldres;
+	tsf_sample *res = TSF_NULL, *oldres;
 	int i, shdrLast = hydra->shdrNum - 1, is_sf3 = 0;
 	for (i = 0; i <= shdrLast; i++)
 	{
@@ -929,13 +1657,13 @@ static int tsf_decode_sf3_samples(const void* rawBuffer, float** pFloatBuffer, u
 			shdr->start = resNum;
 			shdr->startLoop += resNum;
 			shdr->endLoop += resNum;
-			if (!tsf_decode_ogg(pSmpl, pSmplEnd, &res, &resNum, &resMax, resInitial)) { TSF_FREE(res); return 0; }
+			if (!tsf_decode_ogg(pSmpl, pSmplEnd, &res, &resNum, &resMax, resInitial, a)) { tsf_free(a, res); return 0; }
 			shdr->end = resNum;
 			is_sf3 = 1;
 		}
 		else // raw PCM sample
 		{
-			float *out; short *in = (short*)smplBuffer + resNum, *inEnd; tsf_u32 oldResNum = resNum;
+			tsf_sample *out; short *in = (short*)smplBuffer + resNum, *inEnd; tsf_u32 oldResNum = resNum;
 			if (is_sf3) // Fix up sample indices in shdr
 			{
 				tsf_u32 fix_offset = resNum - shdr->start;
@@ -955,48 +1683,54 @@ static int tsf_decode_sf3_samples(const void* rawBuffer, float** pFloatBuffer, u
 			{
 				do { resMax += (resMax ? (resMax < 1048576 ? resMax : 1048576) : resInitial); } while (resNum > resMax);
 				oldres = res;
-				res = (float*)TSF_REALLOC(res, resMax * sizeof(float));
-				if (!res) { TSF_FREE(oldres); return 0; }
+				res = (tsf_sample*)tsf_realloc(a, res, resMax * sizeof(tsf_sample));
+				if (!res) { tsf_free(a, oldres); return 0; }
 			}
 
 			// Convert the samples from short to float
 			for (out = res + oldResNum; in < inEnd;)
-				*(out++) = (float)(*(in++) / 32767.0);
+				*(out++) = TSF_SAMPLE_FROM_SHORT(*(in++));
 		}
 	}
 
 	// Trim the sample buffer down then return success (unless out of memory)
-	if (!(*pFloatBuffer = (float*)TSF_REALLOC(res, resNum * sizeof(float)))) *pFloatBuffer = res;
+	if (!(*pSampleBuffer = (tsf_sample*)tsf_realloc(a, res, resNum * sizeof(tsf_sample)))) *pSampleBuffer = res;
 	*pSmplCount = resNum;
 	return (res ? 1 : 0);
 }
 #endif
 
-static int tsf_load_samples(void** pRawBuffer, float** pFloatBuffer, unsigned int* pSmplCount, struct tsf_riffchunk *chunkSmpl, struct tsf_stream* stream)
+static int tsf_load_samples(void** pRawBuffer, tsf_sample** pSampleBuffer, unsigned int* pSmplCount, struct tsf_riffchunk *chunkSmpl, struct tsf_stream* stream, const struct tsf_allocator* a)
 {
 	#ifdef STB_VORBIS_INCLUDE_STB_VORBIS_H
 	// With OGG Vorbis support we cannot pre-allocate the memory for tsf_decode_sf3_samples
-	tsf_u32 resNum, resMax; float* oldres;
+	tsf_u32 resNum, resMax; tsf_sample* oldres;
 	*pSmplCount = chunkSmpl->size;
-	*pRawBuffer = (void*)TSF_MALLOC(*pSmplCount);
+	*pRawBuffer = (void*)tsf_alloc(a, *pSmplCount);
 	if (!*pRawBuffer || !stream->read(stream->data, *pRawBuffer, chunkSmpl->size)) return 0;
 	if (chunkSmpl->id[3] != 'o') return 1;
 
 	// Decode custom .sfo 'smpo' format where all samples are in a single ogg stream
 	resNum = resMax = 0;
-	if (!tsf_decode_ogg((tsf_u8*)*pRawBuffer, (tsf_u8*)*pRawBuffer + chunkSmpl->size, pFloatBuffer, &resNum, &resMax, 65536)) return 0;
-	oldres = *pFloatBuffer;
-	if (!(*pFloatBuffer = (float*)TSF_REALLOC(*pFloatBuffer, resNum * sizeof(float)))) *pFloatBuffer = oldres;
+	if (!tsf_decode_ogg((tsf_u8*)*pRawBuffer, (tsf_u8*)*pRawBuffer + chunkSmpl->size, pSampleBuffer, &resNum, &resMax, 65536, a)) return 0;
+	oldres = *pSampleBuffer;
+	if (!(*pSampleBuffer = (tsf_sample*)tsf_realloc(a, *pSampleBuffer, resNum * sizeof(tsf_sample)))) *pSampleBuffer = oldres;
 	*pSmplCount = resNum;
-	return (*pFloatBuffer ? 1 : 0);
+	return (*pSampleBuffer ? 1 : 0);
+	#elif defined(TSF_SAMPLES_SHORT)
+	// Keep the samples as they are stored in the file
+	(void)pRawBuffer;
+	*pSmplCount = chunkSmpl->size / (unsigned int)sizeof(short);
+	*pSampleBuffer = (tsf_sample*)tsf_alloc(a, chunkSmpl->size);
+	return (*pSampleBuffer && stream->read(stream->data, *pSampleBuffer, chunkSmpl->size));
 	#else
 	// Inline convert the samples from short to float
 	float *res, *out; const short *in;
 	(void)pRawBuffer;
 	*pSmplCount = chunkSmpl->size / (unsigned int)sizeof(short);
-	*pFloatBuffer = (float*)TSF_MALLOC(*pSmplCount * sizeof(float));
-	if (!*pFloatBuffer || !stream->read(stream->data, *pFloatBuffer, chunkSmpl->size)) return 0;
-	for (res = *pFloatBuffer, out = res + *pSmplCount, in = (short*)res + *pSmplCount; out != res;)
+	*pSampleBuffer = (float*)tsf_alloc(a, *pSmplCount * sizeof(float));
+	if (!*pSampleBuffer || !stream->read(stream->data, *pSampleBuffer, chunkSmpl->size)) return 0;
+	for (res = *pSampleBuffer, out = res + *pSmplCount, in = (short*)res + *pSmplCount; out != res;)
 		*(--out) = (float)(*(--in) / 32767.0);
 	return 1;
 	#endif
@@ -1134,7 +1868,11 @@ static void tsf_voice_envelope_process(struct tsf_voice_envelope* e, int numSamp
 {
 	if (e->slope)
 	{
+		#ifdef TSF_FAST_MATH
+		if (e->segmentIsExponential) e->level *= tsf_powi(e->slope, numSamples);
+		#else
 		if (e->segmentIsExponential) e->level *= TSF_POWF(e->slope, (float)numSamples);
+		#endif
 		else e->level += (e->slope * numSamples);
 	}
 	if ((e->samplesUntilNextSegment -= numSamples) <= 0)
@@ -1144,7 +1882,11 @@ static void tsf_voice_envelope_process(struct tsf_voice_envelope* e, int numSamp
 static void tsf_voice_lowpass_setup(struct tsf_voice_lowpass* e, float Fc)
 {
 	// Lowpass filter from http://www.earlevel.com/main/2012/11/26/biquad-c-source-code/
+	#ifdef TSF_FAST_MATH
+	double K = tsf_tan_pi(Fc), KK = K * K;
+	#else
 	double K = TSF_TAN(TSF_PI * Fc), KK = K * K;
+	#endif
 	double norm = 1 / (1 + K * e->QInv + KK);
 	e->a0 = KK * norm;
 	e->a1 = 2 * e->a0;
@@ -1157,10 +1899,10 @@ static float tsf_voice_lowpass_process(struct tsf_voice_lowpass* e, double In)
 	double Out = In * e->a0 + e->z1; e->z1 = In * e->a1 + e->z2 - e->b1 * Out; e->z2 = In * e->a0 - e->b2 * Out; return (float)Out;
 }
 
-static void tsf_voice_lfo_setup(struct tsf_voice_lfo* e, float delay, int freqCents, float outSampleRate)
+static void tsf_voice_lfo_setup(struct tsf_voice_lfo* e, float delay, float rate, float outSampleRate)
 {
 	e->samplesUntil = (int)(delay * outSampleRate);
-	e->delta = (4.0f * tsf_cents2Hertz((float)freqCents) / outSampleRate);
+	e->delta = rate / outSampleRate;
 	e->level = 0;
 }
 
@@ -1172,9 +1914,91 @@ static void tsf_voice_lfo_process(struct tsf_voice_lfo* e, int blockSamples)
 	else if (e->level < -1.0f) { e->delta = -e->delta; e->level = -2.0f - e->level; }
 }
 
-static void tsf_voice_kill(struct tsf_voice* v)
+static void tsf_voice_kill(tsf* f, struct tsf_voice* v)
 {
+	if (v->playingPreset == -1) return;
 	v->playingPreset = -1;
+
+	// Remove from the active voice list by moving the last entry into its place
+	if (v->activeIndex < f->activeVoiceNum && f->activeVoices[v->activeIndex] == (int)(v - f->voices))
+	{
+		int last = f->activeVoices[--f->activeVoiceNum];
+		f->activeVoices[v->activeIndex] = last;
+		f->voices[last].activeIndex = v->activeIndex;
+	}
+	v->nextFree = f->voiceFreeHead;
+	f->voiceFreeHead = (int)(v - f->voices);
+}
+
+static void tsf_voice_addfree(tsf* f, int first, int end)
+{
+	// Link the voices from first to end into the free list so the lowest index gets used first
+	while (end-- > first)
+	{
+		f->voices[end].playingPreset = -1;
+		f->voices[end].keyChannel = -1;
+		f->voices[end].nextFree = f->voiceFreeHead;
+		f->voiceFreeHead = end;
+	}
+}
+
+static void tsf_voice_linkkey(tsf* f, struct tsf_voice* v, int channel)
+{
+	// Append to the end of the list of voices playing the same key on the channel
+	int* head = &f->channels->channels[channel].keyVoices[v->playingKey];
+	int idx = (int)(v - f->voices);
+	v->keyChannel = channel;
+	v->keyNext = -1;
+	if (*head == -1) { v->keyPrev = idx; *head = idx; return; }
+	v->keyPrev = f->voices[*head].keyPrev;
+	f->voices[v->keyPrev].keyNext = idx;
+	f->voices[*head].keyPrev = idx;
+}
+
+static void tsf_voice_unlinkkey(tsf* f, struct tsf_voice* v)
+{
+	// Voices are only linked and unlinked from the note functions, never during voice rendering
+	int* head = &f->channels->channels[v->keyChannel].keyVoices[v->playingKey];
+	int idx = (int)(v - f->voices);
+	if (*head == idx) *head = v->keyNext;
+	else f->voices[v->keyPrev].keyNext = v->keyNext;
+	if (v->keyNext != -1) f->voices[v->keyNext].keyPrev = v->keyPrev;
+	else if (*head != -1) f->voices[*head].keyPrev = v->keyPrev;
+	v->keyChannel = -1;
+}
+
+static int tsf_voice_resize(tsf* f, int voiceNum)
+{
+	struct tsf_voice* newVoices;
+	int* newActiveVoices = (int*)tsf_realloc(&f->font->allocator, f->activeVoices, voiceNum * sizeof(int));
+	if (!newActiveVoices) return 0;
+	f->activeVoices = newActiveVoices;
+	newVoices = (struct tsf_voice*)tsf_realloc(&f->font->allocator, f->voices, voiceNum * sizeof(struct tsf_voice));
+	if (!newVoices) return 0;
+	f->voices = newVoices;
+	f->voiceNum = voiceNum;
+	return 1;
+}
+
+static struct tsf_voice* tsf_voice_alloc(tsf* f)
+{
+	int i;
+	for (;;)
+	{
+		while (f->voiceFreeHead != -1)
+		{
+			// Skip entries that are already playing again, the list is only a hint if
+			// voice rendering ended a voice on a different thread at the same time
+			struct tsf_voice* v = &f->voices[f->voiceFreeHead];
+			f->voiceFreeHead = v->nextFree;
+			if (v->playingPreset == -1) return v;
+		}
+
+		// Rebuild the free list in case a voice got lost, only happens when all voices are in use
+		for (i = f->voiceNum; i--;)
+			if (f->voices[i].playingPreset == -1) { f->voices[i].nextFree = f->voiceFreeHead; f->voiceFreeHead = i; }
+		if (f->voiceFreeHead == -1) return TSF_NULL;
+	}
 }
 
 static void tsf_voice_end(tsf* f, struct tsf_voice* v)
@@ -1208,33 +2032,630 @@ static void tsf_voice_endquick(tsf* f, struct tsf_voice* v)
 	}
 }
 
-static void tsf_voice_calcpitchratio(struct tsf_voice* v, float pitchShift, float outSampleRate)
+static struct tsf_voice* tsf_voice_steal(tsf* f, enum TSFVoiceSteal policy, int preset_index, int key, int channel, TSF_BOOL takeHeld)
+{
+	// Pick the active voice to take over with the lowest (tier, score) according to the stealing policy
+	// Voices that are already fading out quickly and held voices of the note being started are skipped
+	// The note being started is played on channel, or -1 if it was started without a channel
+	struct tsf_voice *best = TSF_NULL;
+	double bestTier = 0, bestScore = 0;
+	int *active, *activeEnd;
+	for (active = f->activeVoices, activeEnd = active + f->activeVoiceNum; active != activeEnd; active++)
+	{
+		struct tsf_voice* v = &f->voices[*active];
+		TSF_BOOL isReleasing = (v->ampenv.segment >= TSF_SEGMENT_RELEASE);
+		double tier = (isReleasing ? 1 : 2), score = -(double)(f->voicePlayIndex - v->playIndex); // older first
+		if (isReleasing ? (takeHeld && v->ampenv.parameters.release <= 0) : v->playIndex == f->voicePlayIndex - 1) continue;
+		switch (policy)
+		{
+			case TSF_STEAL_RELEASED:
+				if (!isReleasing && !takeHeld) continue;
+				if (isReleasing) score = -(double)(tsf_voice_envelope_release_samples(&v->ampenv, f->outSampleRate) - v->ampenv.samplesUntilNextSegment);
+				break;
+			case TSF_STEAL_OLDEST:
+				break;
+			case TSF_STEAL_QUIETEST:
+				score = v->ampenv.level * tsf_decibelsToGain(v->noteGainDB);
+				break;
+			case TSF_STEAL_SAME_KEY:
+				// Like tsf_note_off, notes started without a channel match the key of the preset on any channel
+				if (v->playingKey == key && v->playingPreset == preset_index && (channel == -1 || v->playingChannel == channel)) tier = 0;
+				break;
+			case TSF_STEAL_CHANNEL_PRIORITY:
+				// Channels can be gone after tsf_reset while their voices are still releasing
+				if (v->playingChannel >= 0 && f->channels && v->playingChannel < f->channels->channelNum) tier += 4.0 * f->channels->channels[v->playingChannel].priority;
+				break;
+		}
+		if (!best || tier < bestTier || (tier == bestTier && score < bestScore)) { best = v; bestTier = tier; bestScore = score; }
+	}
+	return best;
+}
+
+static void tsf_voice_calcpitchratio(struct tsf_voice* v, float pitchShift)
 {
 	double note = v->playingKey + v->region->transpose + v->region->tune / 100.0;
 	double adjustedPitch = v->region->pitch_keycenter + (note - v->region->pitch_keycenter) * (v->region->pitch_keytrack / 100.0);
 	if (pitchShift) adjustedPitch += pitchShift;
 	v->pitchInputTimecents = adjustedPitch * 100.0;
-	v->pitchOutputFactor = v->region->sample_rate / (tsf_timecents2Secsd(v->region->pitch_keycenter * 100.0) * outSampleRate);
 }
 
-static void tsf_voice_render(tsf* f, struct tsf_voice* v, float* outputBuffer, int numSamples)
+#if defined(TSF_SIMD_AVX2)
+// Gather the source sample pairs at 8 indices and interpolate them linearly
+static __m256 tsf_voice_lerp8(const tsf_sample* input, __m256i idx, __m256 alphas)
 {
-	struct tsf_region* region = v->region;
-	float* input = f->fontSamples;
-	float* outL = outputBuffer;
-	float* outR = (f->outputmode == TSF_STEREO_UNWEAVED ? outL + numSamples : TSF_NULL);
-
-	// Cache some values, to give them at least some chance of ending up in registers.
-	TSF_BOOL updateModEnv = (region->modEnvToPitch || region->modEnvToFilterFc);
-	TSF_BOOL updateModLFO = (v->modlfo.delta && (region->modLfoToPitch || region->modLfoToFilterFc || region->modLfoToVolume));
-	TSF_BOOL updateVibLFO = (v->viblfo.delta && (region->vibLfoToPitch));
-	TSF_BOOL isLooping    = (v->loopStart < v->loopEnd);
-	unsigned int tmpLoopStart = v->loopStart, tmpLoopEnd = v->loopEnd;
-	double tmpSampleEndDbl = (double)region->end, tmpLoopEndDbl = (double)tmpLoopEnd + 1.0;
-	double tmpSourceSamplePosition = v->sourceSamplePosition;
-	struct tsf_voice_lowpass tmpLowpass = v->lowpass;
+	#ifdef TSF_SAMPLES_SHORT
+	// A single 32-bit gather fetches both neighboring 16-bit samples
+	__m256i pairs = _mm256_i32gather_epi32((const int*)input, idx, 2);
+	__m256 a = _mm256_cvtepi32_ps(_mm256_srai_epi32(_mm256_slli_epi32(pairs, 16), 16)), b = _mm256_cvtepi32_ps(_mm256_srai_epi32(pairs, 16));
+	#else
+	__m256 a = _mm256_i32gather_ps(input, idx, 4), b = _mm256_i32gather_ps(input + 1, idx, 4);
+	#endif
+	return _mm256_add_ps(_mm256_mul_ps(a, _mm256_sub_ps(_mm256_set1_ps(1.0f), alphas)), _mm256_mul_ps(b, alphas));
+}
+#elif defined(TSF_SIMD_SSE2)
+// Gather the source sample pairs at 4 indices and interpolate them linearly
+static __m128 tsf_voice_lerp4(const tsf_sample* input, __m128i idx, __m128 alphas)
+{
+	int i0 = _mm_cvtsi128_si32(idx), i1 = _mm_cvtsi128_si32(_mm_shuffle_epi32(idx, 1)), i2 = _mm_cvtsi128_si32(_mm_shuffle_epi32(idx, 2)), i3 = _mm_cvtsi128_si32(_mm_shuffle_epi32(idx, 3));
+	#ifdef TSF_SAMPLES_SHORT
+	__m128 a = _mm_cvtepi32_ps(_mm_setr_epi32(input[i0], input[i1], input[i2], input[i3])), b = _mm_cvtepi32_ps(_mm_setr_epi32(input[i0 + 1], input[i1 + 1], input[i2 + 1], input[i3 + 1]));
+	#else
+	__m128 a = _mm_setr_ps(input[i0], input[i1], input[i2], input[i3]), b = _mm_setr_ps(input[i0 + 1], input[i1 + 1], input[i2 + 1], input[i3 + 1]);
+	#endif
+	return _mm_add_ps(_mm_mul_ps(a, _mm_sub_ps(_mm_set1_ps(1.0f), alphas)), _mm_mul_ps(b, alphas));
+}
+#elif defined(TSF_SIMD_NEON) && (defined(TSF_FIXEDPOINT_PHASE) || defined(TSF_SIMD_NEON64))
+// Gather the source sample pairs at 4 indices and interpolate them linearly
+static float32x4_t tsf_voice_lerp4(const tsf_sample* input, uint32x4_t idx, float32x4_t alphas)
+{
+	const tsf_sample *i0 = input + vgetq_lane_u32(idx, 0), *i1 = input + vgetq_lane_u32(idx, 1), *i2 = input + vgetq_lane_u32(idx, 2), *i3 = input + vgetq_lane_u32(idx, 3);
+	float32x4_t a, b;
+	#ifdef TSF_SAMPLES_SHORT
+	int va[4], vb[4];
+	va[0] = i0[0], va[1] = i1[0], va[2] = i2[0], va[3] = i3[0];
+	vb[0] = i0[1], vb[1] = i1[1], vb[2] = i2[1], vb[3] = i3[1];
+	a = vcvtq_f32_s32(vld1q_s32(va)), b = vcvtq_f32_s32(vld1q_s32(vb));
+	#else
+	float va[4], vb[4];
+	va[0] = i0[0], va[1] = i1[0], va[2] = i2[0], va[3] = i3[0];
+	vb[0] = i0[1], vb[1] = i1[1], vb[2] = i2[1], vb[3] = i3[1];
+	a = vld1q_f32(va), b = vld1q_f32(vb);
+	#endif
+	return vaddq_f32(vmulq_f32(a, vsubq_f32(vdupq_n_f32(1.0f), alphas)), vmulq_f32(b, alphas));
+}
+#endif
 
-	TSF_BOOL dynamicLowpass = (region->modLfoToFilterFc || region->modEnvToFilterFc);
+// Resample the source samples with linear interpolation into a block buffer, returns the number of output samples
+// (less than numSamples if the end of the sample has been reached)
+#ifdef TSF_FIXEDPOINT_PHASE
+static TSF_FORCEINLINE int tsf_voice_interpolate(const tsf_sample* input, float* out, int numSamples, tsf_u64* pSourceSamplePosition, tsf_u64 pitchIncrement, tsf_u64 sampleEnd, TSF_BOOL isLooping, unsigned int loopStart, unsigned int loopEnd)
+{
+	tsf_u64 tmpSourceSamplePosition = *pSourceSamplePosition, tmpLoopEndPhase = TSF_PHASE_FROM_INDEX(loopEnd + 1), tmpLoopLength = TSF_PHASE_FROM_INDEX(loopEnd - loopStart + 1);
+	float *outStart = out, *outEnd = out + numSamples;
+	#if defined(TSF_SIMD_SSE2) || defined(TSF_SIMD_NEON)
+	// Multiple samples can be processed at once while none of them can reach the loop end or the sample end
+	tsf_u64 simdLimit = (isLooping && TSF_PHASE_FROM_INDEX(loopEnd) < sampleEnd ? TSF_PHASE_FROM_INDEX(loopEnd) : sampleEnd);
+	if (simdLimit > TSF_PHASE_FROM_INDEX(0x7FFFFFFF)) simdLimit = 0; // indices need to fit into signed 32-bit SIMD lanes
+	#endif
+	for (;;)
+	{
+		unsigned int pos, nextPos;
+		float alpha;
+
+		#if defined(TSF_SIMD_AVX2)
+		if (outEnd - out >= 8 && tmpSourceSamplePosition + 7 * pitchIncrement < simdLimit)
+		{
+			const __m256i step = _mm256_set1_epi64x((long long)(8 * pitchIncrement));
+			const __m256 alphaScale = _mm256_set1_ps(1.0f / 16777216.0f);
+			__m256i posA = _mm256_add_epi64(_mm256_set1_epi64x((long long)tmpSourceSamplePosition), _mm256_setr_epi64x(0, (long long)pitchIncrement, (long long)(2 * pitchIncrement), (long long)(3 * pitchIncrement)));
+			__m256i posB = _mm256_add_epi64(posA, _mm256_set1_epi64x((long long)(4 * pitchIncrement)));
+			for (; outEnd - out >= 8 && tmpSourceSamplePosition + 7 * pitchIncrement < simdLimit; out += 8, tmpSourceSamplePosition += 8 * pitchIncrement, posA = _mm256_add_epi64(posA, step), posB = _mm256_add_epi64(posB, step))
+			{
+				// Split the 64-bit positions into the integer parts (sample indices) and the fractions
+				__m256i idx = _mm256_permute4x64_epi64(_mm256_castps_si256(_mm256_shuffle_ps(_mm256_castsi256_ps(posA), _mm256_castsi256_ps(posB), _MM_SHUFFLE(3, 1, 3, 1))), _MM_SHUFFLE(3, 1, 2, 0));
+				__m256i frac = _mm256_permute4x64_epi64(_mm256_castps_si256(_mm256_shuffle_ps(_mm256_castsi256_ps(posA), _mm256_castsi256_ps(posB), _MM_SHUFFLE(2, 0, 2, 0))), _MM_SHUFFLE(3, 1, 2, 0));
+				_mm256_storeu_ps(out, tsf_voice_lerp8(input, idx, _mm256_mul_ps(_mm256_cvtepi32_ps(_mm256_srli_epi32(frac, 8)), alphaScale)));
+			}
+			if (tmpSourceSamplePosition >= tmpLoopEndPhase && isLooping) tmpSourceSamplePosition -= tmpLoopLength;
+		}
+		#elif defined(TSF_SIMD_SSE2)
+		if (outEnd - out >= 4 && tmpSourceSamplePosition + 3 * pitchIncrement < simdLimit)
+		{
+			const __m128i step = _mm_set1_epi64x((long long)(4 * pitchIncrement));
+			const __m128 alphaScale = _mm_set1_ps(1.0f / 16777216.0f);
+			__m128i posLo = _mm_add_epi64(_mm_set1_epi64x((long long)tmpSourceSamplePosition), _mm_set_epi64x((long long)pitchIncrement, 0));
+			__m128i posHi = _mm_add_epi64(posLo, _mm_set1_epi64x((long long)(2 * pitchIncrement)));
+			for (; outEnd - out >= 4 && tmpSourceSamplePosition + 3 * pitchIncrement < simdLimit; out += 4, tmpSourceSamplePosition += 4 * pitchIncrement, posLo = _mm_add_epi64(posLo, step), posHi = _mm_add_epi64(posHi, step))
+			{
+				// Split the 64-bit positions into the integer parts (sample indices) and the fractions
+				__m128i idx = _mm_castps_si128(_mm_shuffle_ps(_mm_castsi128_ps(posLo), _mm_castsi128_ps(posHi), _MM_SHUFFLE(3, 1, 3, 1)));
+				__m128i frac = _mm_castps_si128(_mm_shuffle_ps(_mm_castsi128_ps(posLo), _mm_castsi128_ps(posHi), _MM_SHUFFLE(2, 0, 2, 0)));
+				_mm_storeu_ps(out, tsf_voice_lerp4(input, idx, _mm_mul_ps(_mm_cvtepi32_ps(_mm_srli_epi32(frac, 8)), alphaScale)));
+			}
+			if (tmpSourceSamplePosition >= tmpLoopEndPhase && isLooping) tmpSourceSamplePosition -= tmpLoopLength;
+		}
+		#elif defined(TSF_SIMD_NEON)
+		if (outEnd - out >= 4 && tmpSourceSamplePosition + 3 * pitchIncrement < simdLimit)
+		{
+			const tsf_u64 steps[4] = { tmpSourceSamplePosition, tmpSourceSamplePosition + pitchIncrement, tmpSourceSamplePosition + 2 * pitchIncrement, tmpSourceSamplePosition + 3 * pitchIncrement };
+			const uint64x2_t step = vdupq_n_u64(4 * pitchIncrement);
+			uint64x2_t posLo = vld1q_u64(steps), posHi = vld1q_u64(steps + 2);
+			for (; outEnd - out >= 4 && tmpSourceSamplePosition + 3 * pitchIncrement < simdLimit; out += 4, tmpSourceSamplePosition += 4 * pitchIncrement, posLo = vaddq_u64(posLo, step), posHi = vaddq_u64(posHi, step))
+			{
+				// Split the 64-bit positions into the integer parts (sample indices) and the fractions
+				uint32x4_t idx = vcombine_u32(vshrn_n_u64(posLo, 32), vshrn_n_u64(posHi, 32));
+				uint32x4_t frac = vcombine_u32(vmovn_u64(posLo), vmovn_u64(posHi));
+				vst1q_f32(out, tsf_voice_lerp4(input, idx, vmulq_n_f32(vcvtq_f32_u32(vshrq_n_u32(frac, 8)), 1.0f / 16777216.0f)));
+			}
+			if (tmpSourceSamplePosition >= tmpLoopEndPhase && isLooping) tmpSourceSamplePosition -= tmpLoopLength;
+		}
+		#endif
+
+		if (out == outEnd || tmpSourceSamplePosition >= sampleEnd) break;
+		pos = (unsigned int)(tmpSourceSamplePosition >> 32), nextPos = (pos >= loopEnd && isLooping ? loopStart : pos + 1);
+
+		// Simple linear interpolation (with the top 24 bits of the fraction which fit exactly into a float).
+		alpha = (float)(int)((tsf_u32)tmpSourceSamplePosition >> 8) * (1.0f / 16777216.0f);
+		*out++ = (input[pos] * (1.0f - alpha) + input[nextPos] * alpha);
+
+		// Next sample.
+		tmpSourceSamplePosition += pitchIncrement;
+		if (tmpSourceSamplePosition >= tmpLoopEndPhase && isLooping) tmpSourceSamplePosition -= tmpLoopLength;
+	}
+	*pSourceSamplePosition = tmpSourceSamplePosition;
+	return (int)(out - outStart);
+}
+#else
+static TSF_FORCEINLINE int tsf_voice_interpolate(const tsf_sample* input, float* out, int numSamples, double* pSourceSamplePosition, double pitchRatio, double sampleEnd, TSF_BOOL isLooping, unsigned int loopStart, unsigned int loopEnd)
+{
+	double tmpSourceSamplePosition = *pSourceSamplePosition, tmpLoopEndDbl = (double)loopEnd + 1.0, tmpLoopLength = (loopEnd - loopStart + 1.0);
+	float *outStart = out, *outEnd = out + numSamples;
+	#if defined(TSF_SIMD_SSE2) || defined(TSF_SIMD_NEON64)
+	// Multiple samples can be processed at once while none of them can reach the loop end or the sample end
+	double simdLimit = (isLooping && loopEnd < sampleEnd ? (double)loopEnd : sampleEnd);
+	if (simdLimit > 2147483647.0) simdLimit = 0; // indices need to fit into signed 32-bit SIMD lanes
+	#endif
+	for (;;)
+	{
+		unsigned int pos, nextPos;
+		float alpha;
+
+		#if defined(TSF_SIMD_AVX2)
+		if (outEnd - out >= 8 && tmpSourceSamplePosition + 7.0 * pitchRatio < simdLimit)
+		{
+			const __m256d stepLo = _mm256_setr_pd(0.0, pitchRatio, 2.0 * pitchRatio, 3.0 * pitchRatio), stepHi = _mm256_setr_pd(4.0 * pitchRatio, 5.0 * pitchRatio, 6.0 * pitchRatio, 7.0 * pitchRatio);
+			for (; outEnd - out >= 8 && tmpSourceSamplePosition + 7.0 * pitchRatio < simdLimit; out += 8, tmpSourceSamplePosition += 8.0 * pitchRatio)
+			{
+				__m256d posLo = _mm256_add_pd(_mm256_set1_pd(tmpSourceSamplePosition), stepLo), posHi = _mm256_add_pd(_mm256_set1_pd(tmpSourceSamplePosition), stepHi);
+				__m128i idxLo = _mm256_cvttpd_epi32(posLo), idxHi = _mm256_cvttpd_epi32(posHi);
+				__m256i idx = _mm256_insertf128_si256(_mm256_castsi128_si256(idxLo), idxHi, 1);
+				__m256 alphas = _mm256_insertf128_ps(_mm256_castps128_ps256(_mm256_cvtpd_ps(_mm256_sub_pd(posLo, _mm256_cvtepi32_pd(idxLo)))), _mm256_cvtpd_ps(_mm256_sub_pd(posHi, _mm256_cvtepi32_pd(idxHi))), 1);
+				_mm256_storeu_ps(out, tsf_voice_lerp8(input, idx, alphas));
+			}
+			if (tmpSourceSamplePosition >= tmpLoopEndDbl && isLooping) tmpSourceSamplePosition -= tmpLoopLength;
+		}
+		#elif defined(TSF_SIMD_SSE2)
+		if (outEnd - out >= 4 && tmpSourceSamplePosition + 3.0 * pitchRatio < simdLimit)
+		{
+			const __m128d stepLo = _mm_setr_pd(0.0, pitchRatio), stepHi = _mm_setr_pd(2.0 * pitchRatio, 3.0 * pitchRatio);
+			for (; outEnd - out >= 4 && tmpSourceSamplePosition + 3.0 * pitchRatio < simdLimit; out += 4, tmpSourceSamplePosition += 4.0 * pitchRatio)
+			{
+				__m128d posLo = _mm_add_pd(_mm_set1_pd(tmpSourceSamplePosition), stepLo), posHi = _mm_add_pd(_mm_set1_pd(tmpSourceSamplePosition), stepHi);
+				__m128i idxLo = _mm_cvttpd_epi32(posLo), idxHi = _mm_cvttpd_epi32(posHi);
+				__m128 alphas = _mm_movelh_ps(_mm_cvtpd_ps(_mm_sub_pd(posLo, _mm_cvtepi32_pd(idxLo))), _mm_cvtpd_ps(_mm_sub_pd(posHi, _mm_cvtepi32_pd(idxHi))));
+				_mm_storeu_ps(out, tsf_voice_lerp4(input, _mm_unpacklo_epi64(idxLo, idxHi), alphas));
+			}
+			if (tmpSourceSamplePosition >= tmpLoopEndDbl && isLooping) tmpSourceSamplePosition -= tmpLoopLength;
+		}
+		#elif defined(TSF_SIMD_NEON64)
+		if (outEnd - out >= 4 && tmpSourceSamplePosition + 3.0 * pitchRatio < simdLimit)
+		{
+			const double steps[4] = { 0.0, pitchRatio, 2.0 * pitchRatio, 3.0 * pitchRatio };
+			const float64x2_t stepLo = vld1q_f64(steps), stepHi = vld1q_f64(steps + 2);
+			for (; outEnd - out >= 4 && tmpSourceSamplePosition + 3.0 * pitchRatio < simdLimit; out += 4, tmpSourceSamplePosition += 4.0 * pitchRatio)
+			{
+				float64x2_t posLo = vaddq_f64(vdupq_n_f64(tmpSourceSamplePosition), stepLo), posHi = vaddq_f64(vdupq_n_f64(tmpSourceSamplePosition), stepHi);
+				int64x2_t idxLo = vcvtq_s64_f64(posLo), idxHi = vcvtq_s64_f64(posHi);
+				float32x4_t alphas = vcombine_f32(vcvt_f32_f64(vsubq_f64(posLo, vcvtq_f64_s64(idxLo))), vcvt_f32_f64(vsubq_f64(posHi, vcvtq_f64_s64(idxHi))));
+				vst1q_f32(out, tsf_voice_lerp4(input, vcombine_u32(vmovn_u64(vreinterpretq_u64_s64(idxLo)), vmovn_u64(vreinterpretq_u64_s64(idxHi))), alphas));
+			}
+			if (tmpSourceSamplePosition >= tmpLoopEndDbl && isLooping) tmpSourceSamplePosition -= tmpLoopLength;
+		}
+		#endif
+
+		if (out == outEnd || tmpSourceSamplePosition >= sampleEnd) break;
+		pos = (unsigned int)tmpSourceSamplePosition, nextPos = (pos >= loopEnd && isLooping ? loopStart : pos + 1);
+
+		// Simple linear interpolation.
+		alpha = (float)(tmpSourceSamplePosition - pos);
+		*out++ = (input[pos] * (1.0f - alpha) + input[nextPos] * alpha);
+
+		// Next sample.
+		tmpSourceSamplePosition += pitchRatio;
+		if (tmpSourceSamplePosition >= tmpLoopEndDbl && isLooping) tmpSourceSamplePosition -= tmpLoopLength;
+	}
+	*pSourceSamplePosition = tmpSourceSamplePosition;
+	return (int)(out - outStart);
+}
+#endif
+
+// Read a single source sample for the taps of the cubic and sinc interpolation, taps past the loop end wrap around
+// to the loop start and taps outside of the sample data are silent
+static float tsf_voice_tap(const tsf_sample* input, int index, int end, TSF_BOOL isLooping, int loopStart, int loopEnd)
+{
+	if (isLooping) while (index > loopEnd) index -= loopEnd - loopStart + 1;
+	return (index < 0 || index >= end ? 0.0f : (float)input[index]);
+}
+
+#if defined(TSF_SIMD_SSE2)
+// Load 4 consecutive source samples as floats
+static __m128 tsf_voice_load4(const tsf_sample* input)
+{
+	#ifdef TSF_SAMPLES_SHORT
+	__m128i v = _mm_loadl_epi64((const __m128i*)input);
+	return _mm_cvtepi32_ps(_mm_srai_epi32(_mm_unpacklo_epi16(v, v), 16));
+	#else
+	return _mm_loadu_ps(input);
+	#endif
+}
+#elif defined(TSF_SIMD_NEON)
+// Load 4 consecutive source samples as floats
+static float32x4_t tsf_voice_load4(const tsf_sample* input)
+{
+	#ifdef TSF_SAMPLES_SHORT
+	return vcvtq_f32_s32(vmovl_s16(vld1_s16(input)));
+	#else
+	return vld1q_f32(input);
+	#endif
+}
+
+// Turn 4 vectors of 4 values for each output sample into 4 vectors of one value for all output samples
+static void tsf_voice_transpose4(float32x4_t* r0, float32x4_t* r1, float32x4_t* r2, float32x4_t* r3)
+{
+	float32x4x2_t t01 = vtrnq_f32(*r0, *r1), t23 = vtrnq_f32(*r2, *r3);
+	*r0 = vcombine_f32(vget_low_f32(t01.val[0]), vget_low_f32(t23.val[0]));
+	*r1 = vcombine_f32(vget_low_f32(t01.val[1]), vget_low_f32(t23.val[1]));
+	*r2 = vcombine_f32(vget_high_f32(t01.val[0]), vget_high_f32(t23.val[0]));
+	*r3 = vcombine_f32(vget_high_f32(t01.val[1]), vget_high_f32(t23.val[1]));
+}
+#endif
+
+// Resample the source samples with 4-point cubic Hermite interpolation into a block buffer, returns the number of output samples
+// (less than numSamples if the end of the sample has been reached)
+static TSF_FORCEINLINE int tsf_voice_interpolate_cubic(const tsf_sample* input, float* out, int numSamples, tsf_phase* pSourceSamplePosition, tsf_phase pitchIncrement, tsf_phase sampleEnd, TSF_BOOL isLooping, unsigned int loopStart, unsigned int loopEnd)
+{
+	tsf_phase tmpSourceSamplePosition = *pSourceSamplePosition, tmpLoopEndPhase = TSF_PHASE_FROM_INDEX(loopEnd + 1), tmpLoopLength = TSF_PHASE_FROM_INDEX(loopEnd - loopStart + 1);
+	int end = (int)TSF_PHASE_INDEX(sampleEnd);
+	float *outStart = out, *outEnd = out + numSamples;
+	#if defined(TSF_SIMD_SSE2) || defined(TSF_SIMD_NEON)
+	// Multiple samples can be processed at once while all their taps (from pos - 1 to pos + 2) lie before the loop end or the sample end
+	int lastTap = (isLooping && (int)loopEnd < end ? (int)loopEnd : end - 1);
+	tsf_phase simdStart = TSF_PHASE_FROM_INDEX(1), simdLimit = (lastTap >= 2 ? TSF_PHASE_FROM_INDEX(lastTap - 1) : 0);
+	#endif
+	for (;;)
+	{
+		int pos;
+		float alpha, tm1, t0, t1, t2;
+
+		#if defined(TSF_SIMD_SSE2)
+		if (outEnd - out >= 4 && tmpSourceSamplePosition >= simdStart && tmpSourceSamplePosition + 3 * pitchIncrement < simdLimit)
+		{
+			const __m128 half = _mm_set1_ps(0.5f), oneHalf = _mm_set1_ps(1.5f), two = _mm_set1_ps(2.0f), twoHalf = _mm_set1_ps(2.5f);
+			for (; outEnd - out >= 4 && tmpSourceSamplePosition + 3 * pitchIncrement < simdLimit; out += 4, tmpSourceSamplePosition += 4 * pitchIncrement)
+			{
+				tsf_phase p1 = tmpSourceSamplePosition + pitchIncrement, p2 = p1 + pitchIncrement, p3 = p2 + pitchIncrement;
+				__m128 alphas = _mm_setr_ps(TSF_PHASE_FRACTION(tmpSourceSamplePosition), TSF_PHASE_FRACTION(p1), TSF_PHASE_FRACTION(p2), TSF_PHASE_FRACTION(p3));
+				__m128 xm1 = tsf_voice_load4(input + TSF_PHASE_INDEX(tmpSourceSamplePosition) - 1), x0 = tsf_voice_load4(input + TSF_PHASE_INDEX(p1) - 1);
+				__m128 x1 = tsf_voice_load4(input + TSF_PHASE_INDEX(p2) - 1), x2 = tsf_voice_load4(input + TSF_PHASE_INDEX(p3) - 1);
+				__m128 c1, c2, c3;
+				// The 4 taps were loaded per output sample, transpose them into one vector per tap
+				_MM_TRANSPOSE4_PS(xm1, x0, x1, x2);
+				c1 = _mm_mul_ps(half, _mm_sub_ps(x1, xm1));
+				c2 = _mm_sub_ps(_mm_add_ps(xm1, _mm_mul_ps(two, x1)), _mm_add_ps(_mm_mul_ps(twoHalf, x0), _mm_mul_ps(half, x2)));
+				c3 = _mm_add_ps(_mm_mul_ps(half, _mm_sub_ps(x2, xm1)), _mm_mul_ps(oneHalf, _mm_sub_ps(x0, x1)));
+				_mm_storeu_ps(out, _mm_add_ps(_mm_mul_ps(_mm_add_ps(_mm_mul_ps(_mm_add_ps(_mm_mul_ps(c3, alphas), c2), alphas), c1), alphas), x0));
+			}
+			if (tmpSourceSamplePosition >= tmpLoopEndPhase && isLooping) tmpSourceSamplePosition -= tmpLoopLength;
+		}
+		#elif defined(TSF_SIMD_NEON)
+		if (outEnd - out >= 4 && tmpSourceSamplePosition >= simdStart && tmpSourceSamplePosition + 3 * pitchIncrement < simdLimit)
+		{
+			for (; outEnd - out >= 4 && tmpSourceSamplePosition + 3 * pitchIncrement < simdLimit; out += 4, tmpSourceSamplePosition += 4 * pitchIncrement)
+			{
+				tsf_phase p1 = tmpSourceSamplePosition + pitchIncrement, p2 = p1 + pitchIncrement, p3 = p2 + pitchIncrement;
+				float fractions[4];
+				float32x4_t alphas, xm1, x0, x1, x2, c1, c2, c3;
+				fractions[0] = TSF_PHASE_FRACTION(tmpSourceSamplePosition), fractions[1] = TSF_PHASE_FRACTION(p1), fractions[2] = TSF_PHASE_FRACTION(p2), fractions[3] = TSF_PHASE_FRACTION(p3);
+				alphas = vld1q_f32(fractions);
+				xm1 = tsf_voice_load4(input + TSF_PHASE_INDEX(tmpSourceSamplePosition) - 1), x0 = tsf_voice_load4(input + TSF_PHASE_INDEX(p1) - 1);
+				x1 = tsf_voice_load4(input + TSF_PHASE_INDEX(p2) - 1), x2 = tsf_voice_load4(input + TSF_PHASE_INDEX(p3) - 1);
+				// The 4 taps were loaded per output sample, transpose them into one vector per tap
+				tsf_voice_transpose4(&xm1, &x0, &x1, &x2);
+				c1 = vmulq_n_f32(vsubq_f32(x1, xm1), 0.5f);
+				c2 = vsubq_f32(vaddq_f32(xm1, vmulq_n_f32(x1, 2.0f)), vaddq_f32(vmulq_n_f32(x0, 2.5f), vmulq_n_f32(x2, 0.5f)));
+				c3 = vaddq_f32(vmulq_n_f32(vsubq_f32(x2, xm1), 0.5f), vmulq_n_f32(vsubq_f32(x0, x1), 1.5f));
+				vst1q_f32(out, vaddq_f32(vmulq_f32(vaddq_f32(vmulq_f32(vaddq_f32(vmulq_f32(c3, alphas), c2), alphas), c1), alphas), x0));
+			}
+			if (tmpSourceSamplePosition >= tmpLoopEndPhase && isLooping) tmpSourceSamplePosition -= tmpLoopLength;
+		}
+		#endif
+
+		if (out == outEnd || tmpSourceSamplePosition >= sampleEnd) break;
+		pos = (int)TSF_PHASE_INDEX(tmpSourceSamplePosition);
+		alpha = TSF_PHASE_FRACTION(tmpSourceSamplePosition);
+		tm1 = tsf_voice_tap(input, pos - 1, end, isLooping, (int)loopStart, (int)loopEnd);
+		t0  = tsf_voice_tap(input, pos,     end, isLooping, (int)loopStart, (int)loopEnd);
+		t1  = tsf_voice_tap(input, pos + 1, end, isLooping, (int)loopStart, (int)loopEnd);
+		t2  = tsf_voice_tap(input, pos + 2, end, isLooping, (int)loopStart, (int)loopEnd);
+
+		// Catmull-Rom spline through the 4 taps evaluated at the fraction between t0 and t1
+		*out++ = (((0.5f * (t2 - tm1) + 1.5f * (t0 - t1)) * alpha + ((tm1 + 2.0f * t1) - (2.5f * t0 + 0.5f * t2))) * alpha + 0.5f * (t1 - tm1)) * alpha + t0;
+
+		// Next sample.
+		tmpSourceSamplePosition += pitchIncrement;
+		if (tmpSourceSamplePosition >= tmpLoopEndPhase && isLooping) tmpSourceSamplePosition -= tmpLoopLength;
+	}
+	*pSourceSamplePosition = tmpSourceSamplePosition;
+	return (int)(out - outStart);
+}
+
+// Resample the source samples with an 8-point windowed sinc into a block buffer, returns the number of output samples
+// (less than numSamples if the end of the sample has been reached)
+// The filter coefficients are interpolated linearly between the two nearest rows of the polyphase table.
+static TSF_FORCEINLINE int tsf_voice_interpolate_sinc(const float* table, const tsf_sample* input, float* out, int numSamples, tsf_phase* pSourceSamplePosition, tsf_phase pitchIncrement, tsf_phase sampleEnd, TSF_BOOL isLooping, unsigned int loopStart, unsigned int loopEnd)
+{
+	tsf_phase tmpSourceSamplePosition = *pSourceSamplePosition, tmpLoopEndPhase = TSF_PHASE_FROM_INDEX(loopEnd + 1), tmpLoopLength = TSF_PHASE_FROM_INDEX(loopEnd - loopStart + 1);
+	int end = (int)TSF_PHASE_INDEX(sampleEnd);
+	float *outStart = out, *outEnd = out + numSamples;
+	#if defined(TSF_SIMD_SSE2) || defined(TSF_SIMD_NEON)
+	// Multiple samples can be processed at once while all their taps (from pos - 3 to pos + 4) lie before the loop end or the sample end
+	int lastTap = (isLooping && (int)loopEnd < end ? (int)loopEnd : end - 1);
+	tsf_phase simdStart = TSF_PHASE_FROM_INDEX(3), simdLimit = (lastTap >= 4 ? TSF_PHASE_FROM_INDEX(lastTap - 3) : 0);
+	#endif
+	for (;;)
+	{
+		int pos, k, row;
+		float phase, blend, sum;
+		const float* coefs;
+
+		#if defined(TSF_SIMD_SSE2)
+		if (outEnd - out >= 4 && tmpSourceSamplePosition >= simdStart && tmpSourceSamplePosition + 3 * pitchIncrement < simdLimit)
+		{
+			for (; outEnd - out >= 4 && tmpSourceSamplePosition + 3 * pitchIncrement < simdLimit; out += 4)
+			{
+				__m128 sums[4];
+				for (k = 0; k != 4; k++, tmpSourceSamplePosition += pitchIncrement)
+				{
+					const tsf_sample* taps = input + TSF_PHASE_INDEX(tmpSourceSamplePosition) - 3;
+					__m128 b, lo, hi;
+					phase = TSF_PHASE_FRACTION(tmpSourceSamplePosition) * TSF_SINC_PHASES, row = (int)phase;
+					b = _mm_set1_ps(phase - (float)row), coefs = table + row * 8;
+					lo = _mm_add_ps(_mm_loadu_ps(coefs),     _mm_mul_ps(b, _mm_sub_ps(_mm_loadu_ps(coefs + 8),  _mm_loadu_ps(coefs))));
+					hi = _mm_add_ps(_mm_loadu_ps(coefs + 4), _mm_mul_ps(b, _mm_sub_ps(_mm_loadu_ps(coefs + 12), _mm_loadu_ps(coefs + 4))));
+					sums[k] = _mm_add_ps(_mm_mul_ps(tsf_voice_load4(taps), lo), _mm_mul_ps(tsf_voice_load4(taps + 4), hi));
+				}
+				// Add up the partial sums of all 4 output samples at once
+				_MM_TRANSPOSE4_PS(sums[0], sums[1], sums[2], sums[3]);
+				_mm_storeu_ps(out, _mm_add_ps(_mm_add_ps(sums[0], sums[1]), _mm_add_ps(sums[2], sums[3])));
+			}
+			if (tmpSourceSamplePosition >= tmpLoopEndPhase && isLooping) tmpSourceSamplePosition -= tmpLoopLength;
+		}
+		#elif defined(TSF_SIMD_NEON)
+		if (outEnd - out >= 4 && tmpSourceSamplePosition >= simdStart && tmpSourceSamplePosition + 3 * pitchIncrement < simdLimit)
+		{
+			for (; outEnd - out >= 4 && tmpSourceSamplePosition + 3 * pitchIncrement < simdLimit; out += 4)
+			{
+				float32x4_t sums[4];
+				for (k = 0; k != 4; k++, tmpSourceSamplePosition += pitchIncrement)
+				{
+					const tsf_sample* taps = input + TSF_PHASE_INDEX(tmpSourceSamplePosition) - 3;
+					float32x4_t lo, hi;
+					phase = TSF_PHASE_FRACTION(tmpSourceSamplePosition) * TSF_SINC_PHASES, row = (int)phase;
+					blend = phase - (float)row, coefs = table + row * 8;
+					lo = vaddq_f32(vld1q_f32(coefs),     vmulq_n_f32(vsubq_f32(vld1q_f32(coefs + 8),  vld1q_f32(coefs)),     blend));
+					hi = vaddq_f32(vld1q_f32(coefs + 4), vmulq_n_f32(vsubq_f32(vld1q_f32(coefs + 12), vld1q_f32(coefs + 4)), blend));
+					sums[k] = vaddq_f32(vmulq_f32(tsf_voice_load4(taps), lo), vmulq_f32(tsf_voice_load4(taps + 4), hi));
+				}
+				// Add up the partial sums of all 4 output samples at once
+				tsf_voice_transpose4(&sums[0], &sums[1], &sums[2], &sums[3]);
+				vst1q_f32(out, vaddq_f32(vaddq_f32(sums[0], sums[1]), vaddq_f32(sums[2], sums[3])));
+			}
+			if (tmpSourceSamplePosition >= tmpLoopEndPhase && isLooping) tmpSourceSamplePosition -= tmpLoopLength;
+		}
+		#endif
+
+		if (out == outEnd || tmpSourceSamplePosition >= sampleEnd) break;
+		pos = (int)TSF_PHASE_INDEX(tmpSourceSamplePosition);
+		phase = TSF_PHASE_FRACTION(tmpSourceSamplePosition) * TSF_SINC_PHASES, row = (int)phase;
+		blend = phase - (float)row, coefs = table + row * 8;
+		for (sum = 0, k = 0; k != 8; k++)
+			sum += tsf_voice_tap(input, pos - 3 + k, end, isLooping, (int)loopStart, (int)loopEnd) * (coefs[k] + blend * (coefs[k + 8] - coefs[k]));
+		*out++ = sum;
+
+		// Next sample.
+		tmpSourceSamplePosition += pitchIncrement;
+		if (tmpSourceSamplePosition >= tmpLoopEndPhase && isLooping) tmpSourceSamplePosition -= tmpLoopLength;
+	}
+	*pSourceSamplePosition = tmpSourceSamplePosition;
+	return (int)(out - outStart);
+}
+
+// Apply gain to a block of voice samples and accumulate them into a mono output
+static void tsf_voice_mix_mono(float* out, const float* in, int numSamples, float gain)
+{
+	const float* inEnd = in + numSamples;
+	#if defined(TSF_SIMD_SSE2)
+	const __m128 g = _mm_set1_ps(gain);
+	for (; inEnd - in >= 4; in += 4, out += 4)
+		_mm_storeu_ps(out, _mm_add_ps(_mm_loadu_ps(out), _mm_mul_ps(_mm_loadu_ps(in), g)));
+	#elif defined(TSF_SIMD_NEON)
+	const float32x4_t g = vdupq_n_f32(gain);
+	for (; inEnd - in >= 4; in += 4, out += 4)
+		vst1q_f32(out, vaddq_f32(vld1q_f32(out), vmulq_f32(vld1q_f32(in), g)));
+	#endif
+	while (in != inEnd) *out++ += *in++ * gain;
+}
+
+// Apply gain to a block of voice samples and accumulate them into separate left and right outputs
+static void tsf_voice_mix_unweaved(float* outL, float* outR, const float* in, int numSamples, float gainLeft, float gainRight)
+{
+	const float* inEnd = in + numSamples;
+	#if defined(TSF_SIMD_SSE2)
+	const __m128 gL = _mm_set1_ps(gainLeft), gR = _mm_set1_ps(gainRight);
+	for (; inEnd - in >= 4; in += 4, outL += 4, outR += 4)
+	{
+		__m128 val = _mm_loadu_ps(in);
+		_mm_storeu_ps(outL, _mm_add_ps(_mm_loadu_ps(outL), _mm_mul_ps(val, gL)));
+		_mm_storeu_ps(outR, _mm_add_ps(_mm_loadu_ps(outR), _mm_mul_ps(val, gR)));
+	}
+	#elif defined(TSF_SIMD_NEON)
+	const float32x4_t gL = vdupq_n_f32(gainLeft), gR = vdupq_n_f32(gainRight);
+	for (; inEnd - in >= 4; in += 4, outL += 4, outR += 4)
+	{
+		float32x4_t val = vld1q_f32(in);
+		vst1q_f32(outL, vaddq_f32(vld1q_f32(outL), vmulq_f32(val, gL)));
+		vst1q_f32(outR, vaddq_f32(vld1q_f32(outR), vmulq_f32(val, gR)));
+	}
+	#endif
+	for (; in != inEnd; in++)
+	{
+		*outL++ += *in * gainLeft;
+		*outR++ += *in * gainRight;
+	}
+}
+
+// Apply gain to a block of voice samples and accumulate them into an interleaved stereo output
+static void tsf_voice_mix_interleaved(float* out, const float* in, int numSamples, float gainLeft, float gainRight)
+{
+	const float* inEnd = in + numSamples;
+	#if defined(TSF_SIMD_SSE2)
+	const __m128 g = _mm_setr_ps(gainLeft, gainRight, gainLeft, gainRight);
+	for (; inEnd - in >= 4; in += 4, out += 8)
+	{
+		__m128 val = _mm_loadu_ps(in);
+		_mm_storeu_ps(out,     _mm_add_ps(_mm_loadu_ps(out),     _mm_mul_ps(_mm_unpacklo_ps(val, val), g)));
+		_mm_storeu_ps(out + 4, _mm_add_ps(_mm_loadu_ps(out + 4), _mm_mul_ps(_mm_unpackhi_ps(val, val), g)));
+	}
+	#elif defined(TSF_SIMD_NEON)
+	const float32x4_t gL = vdupq_n_f32(gainLeft), gR = vdupq_n_f32(gainRight);
+	for (; inEnd - in >= 4; in += 4, out += 8)
+	{
+		float32x4_t val = vld1q_f32(in);
+		float32x4x2_t lr = vld2q_f32(out);
+		lr.val[0] = vaddq_f32(lr.val[0], vmulq_f32(val, gL));
+		lr.val[1] = vaddq_f32(lr.val[1], vmulq_f32(val, gR));
+		vst2q_f32(out, lr);
+	}
+	#endif
+	for (; in != inEnd; in++)
+	{
+		*out++ += *in * gainLeft;
+		*out++ += *in * gainRight;
+	}
+}
+
+// State of a voice shared by the block kernels while it renders
+struct tsf_voice_block
+{
+	const float* sincTable;
+	const tsf_sample* input;
+	tsf_phase sourceSamplePosition, pitchIncrement, sampleEnd;
+	unsigned int loopStart, loopEnd;
+	struct tsf_voice_lowpass lowpass;
+};
+
+// Interpolation stages of the block kernels
+#define TSF_BLOCK_LINEAR(b, out, numSamples, isLooping) tsf_voice_interpolate((b)->input, out, numSamples, &(b)->sourceSamplePosition, (b)->pitchIncrement, (b)->sampleEnd, isLooping, (b)->loopStart, (b)->loopEnd)
+#define TSF_BLOCK_CUBIC(b, out, numSamples, isLooping) tsf_voice_interpolate_cubic((b)->input, out, numSamples, &(b)->sourceSamplePosition, (b)->pitchIncrement, (b)->sampleEnd, isLooping, (b)->loopStart, (b)->loopEnd)
+#define TSF_BLOCK_SINC(b, out, numSamples, isLooping) tsf_voice_interpolate_sinc((b)->sincTable, (b)->input, out, numSamples, &(b)->sourceSamplePosition, (b)->pitchIncrement, (b)->sampleEnd, isLooping, (b)->loopStart, (b)->loopEnd)
+
+// Output stages of the block kernels, they also advance the output pointers
+static TSF_FORCEINLINE void tsf_voice_block_interleaved(float** pOutL, float** pOutR, const float* in, int numSamples, float gainMono, float panLeft, float panRight)
+{
+	tsf_voice_mix_interleaved(*pOutL, in, numSamples, gainMono * panLeft, gainMono * panRight);
+	*pOutL += numSamples * 2;
+	(void)pOutR;
+}
+
+static TSF_FORCEINLINE void tsf_voice_block_unweaved(float** pOutL, float** pOutR, const float* in, int numSamples, float gainMono, float panLeft, float panRight)
+{
+	tsf_voice_mix_unweaved(*pOutL, *pOutR, in, numSamples, gainMono * panLeft, gainMono * panRight);
+	*pOutL += numSamples;
+	*pOutR += numSamples;
+}
+
+static TSF_FORCEINLINE void tsf_voice_block_mono(float** pOutL, float** pOutR, const float* in, int numSamples, float gainMono, float panLeft, float panRight)
+{
+	tsf_voice_mix_mono(*pOutL, in, numSamples, gainMono);
+	*pOutL += numSamples;
+	(void)pOutR, (void)panLeft, (void)panRight;
+}
+
+// Resample, filter and mix one block of a voice, returns the number of samples rendered (less than numSamples if the end of the sample has been reached)
+// Each combination of interpolation, looping, filter and output mode gets its own instance so the compiler can drop the branches on them.
+typedef int (*tsf_voice_block_kernel)(struct tsf_voice_block* b, float** pOutL, float** pOutR, int numSamples, float gainMono, float panLeft, float panRight);
+
+#define TSF_BLOCK_KERNEL(name, INTERPOLATE, isLooping, isFiltered, MIX) \
+	static int name(struct tsf_voice_block* b, float** pOutL, float** pOutR, int numSamples, float gainMono, float panLeft, float panRight) \
+	{ \
+		float buffer[TSF_RENDER_EFFECTSAMPLEBLOCK]; \
+		numSamples = INTERPOLATE(b, buffer, numSamples, isLooping); \
+		if (isFiltered) \
+		{ \
+			struct tsf_voice_lowpass lowpass = b->lowpass; \
+			float *val = buffer, *valEnd = buffer + numSamples; \
+			for (; val != valEnd; val++) *val = tsf_voice_lowpass_process(&lowpass, *val); \
+			b->lowpass = lowpass; \
+		} \
+		MIX(pOutL, pOutR, buffer, numSamples, gainMono, panLeft, panRight); \
+		return numSamples; \
+	}
+#define TSF_BLOCK_KERNEL_MIXES(name, INTERPOLATE, isLooping, isFiltered) \
+	TSF_BLOCK_KERNEL(name##_interleaved, INTERPOLATE, isLooping, isFiltered, tsf_voice_block_interleaved) \
+	TSF_BLOCK_KERNEL(name##_unweaved,    INTERPOLATE, isLooping, isFiltered, tsf_voice_block_unweaved) \
+	TSF_BLOCK_KERNEL(name##_mono,        INTERPOLATE, isLooping, isFiltered, tsf_voice_block_mono)
+#define TSF_BLOCK_KERNEL_VARIANTS(name, INTERPOLATE) \
+	TSF_BLOCK_KERNEL_MIXES(name##_oneshot,          INTERPOLATE, TSF_FALSE, TSF_FALSE) \
+	TSF_BLOCK_KERNEL_MIXES(name##_oneshot_lowpass,  INTERPOLATE, TSF_FALSE, TSF_TRUE) \
+	TSF_BLOCK_KERNEL_MIXES(name##_looping,          INTERPOLATE, TSF_TRUE,  TSF_FALSE) \
+	TSF_BLOCK_KERNEL_MIXES(name##_looping_lowpass,  INTERPOLATE, TSF_TRUE,  TSF_TRUE)
+TSF_BLOCK_KERNEL_VARIANTS(tsf_voice_block_linear, TSF_BLOCK_LINEAR)
+TSF_BLOCK_KERNEL_VARIANTS(tsf_voice_block_cubic,  TSF_BLOCK_CUBIC)
+TSF_BLOCK_KERNEL_VARIANTS(tsf_voice_block_sinc,   TSF_BLOCK_SINC)
+
+// Indexed by [interpolation][looping][lowpass][output mode] with the output modes in the order of enum TSFOutputMode
+#define TSF_BLOCK_KERNEL_ENTRIES(name) name##_interleaved, name##_unweaved, name##_mono
+#define TSF_BLOCK_KERNEL_VARIANT_ENTRIES(name) \
+	TSF_BLOCK_KERNEL_ENTRIES(name##_oneshot), TSF_BLOCK_KERNEL_ENTRIES(name##_oneshot_lowpass), \
+	TSF_BLOCK_KERNEL_ENTRIES(name##_looping), TSF_BLOCK_KERNEL_ENTRIES(name##_looping_lowpass)
+static const tsf_voice_block_kernel tsf_voice_block_kernels[3 * 2 * 2 * 3] =
+{
+	TSF_BLOCK_KERNEL_VARIANT_ENTRIES(tsf_voice_block_linear),
+	TSF_BLOCK_KERNEL_VARIANT_ENTRIES(tsf_voice_block_cubic),
+	TSF_BLOCK_KERNEL_VARIANT_ENTRIES(tsf_voice_block_sinc)
+};
+#undef TSF_BLOCK_KERNEL_VARIANT_ENTRIES
+#undef TSF_BLOCK_KERNEL_ENTRIES
+#undef TSF_BLOCK_KERNEL_VARIANTS
+#undef TSF_BLOCK_KERNEL_MIXES
+#undef TSF_BLOCK_KERNEL
+#undef TSF_BLOCK_SINC
+#undef TSF_BLOCK_CUBIC
+#undef TSF_BLOCK_LINEAR
+
+static void tsf_voice_render(tsf* f, struct tsf_voice* v, float* outL, float* outR, int numSamples)
+{
+	struct tsf_region* region = v->region;
+	struct tsf_voice_block block;
+	const tsf_voice_block_kernel* kernels;
+
+	// Cache some values, to give them at least some chance of ending up in registers.
+	TSF_BOOL updateModEnv = (region->modEnvToPitch || region->modEnvToFilterFc);
+	TSF_BOOL updateModLFO = (v->modlfo.delta && (region->modLfoToPitch || region->modLfoToFilterFc || region->modLfoToVolume));
+	TSF_BOOL updateVibLFO = (v->viblfo.delta && (region->vibLfoToPitch));
+	TSF_BOOL isLooping    = (v->loopStart < v->loopEnd);
+
+	TSF_BOOL dynamicLowpass = (region->modLfoToFilterFc || region->modEnvToFilterFc);
 	float tmpSampleRate = f->outSampleRate, tmpInitialFilterFc, tmpModLfoToFilterFc, tmpModEnvToFilterFc;
 
 	TSF_BOOL dynamicPitchRatio = (region->modLfoToPitch || region->modEnvToPitch || region->vibLfoToPitch);
@@ -1242,20 +2663,40 @@ static void tsf_voice_render(tsf* f, struct tsf_voice* v, float* outputBuffer, i
 	float tmpModLfoToPitch, tmpVibLfoToPitch, tmpModEnvToPitch;
 
 	TSF_BOOL dynamicGain = (region->modLfoToVolume != 0);
-	float noteGain = 0, tmpModLfoToVolume;
+	float noteGain = 0, tmpModLfoToVolume, peakGain = 0;
 
 	if (dynamicLowpass) tmpInitialFilterFc = (float)region->initialFilterFc, tmpModLfoToFilterFc = (float)region->modLfoToFilterFc, tmpModEnvToFilterFc = (float)region->modEnvToFilterFc;
 	else tmpInitialFilterFc = 0, tmpModLfoToFilterFc = 0, tmpModEnvToFilterFc = 0;
 
 	if (dynamicPitchRatio) pitchRatio = 0, tmpModLfoToPitch = (float)region->modLfoToPitch, tmpVibLfoToPitch = (float)region->vibLfoToPitch, tmpModEnvToPitch = (float)region->modEnvToPitch;
 	else pitchRatio = tsf_timecents2Secsd(v->pitchInputTimecents) * v->pitchOutputFactor, tmpModLfoToPitch = 0, tmpVibLfoToPitch = 0, tmpModEnvToPitch = 0;
+	block.pitchIncrement = TSF_PHASE_FROM_RATIO(pitchRatio);
 
 	if (dynamicGain) tmpModLfoToVolume = (float)region->modLfoToVolume * 0.1f;
 	else noteGain = tsf_decibelsToGain(v->noteGainDB), tmpModLfoToVolume = 0;
 
+	if (f->silenceGain)
+	{
+		// Highest gain the voice can reach at its current envelope level, including LFO volume modulation and filter resonance
+		float peakGainDB = v->noteGainDB + (tmpModLfoToVolume < 0 ? -tmpModLfoToVolume : tmpModLfoToVolume);
+		if (v->lowpass.QInv < 1.0) peakGainDB -= tsf_gainToDecibels((float)v->lowpass.QInv);
+		peakGain = tsf_decibelsToGain(peakGainDB);
+	}
+
+	block.sincTable = f->sincTable;
+	block.input = f->font->presets[v->playingPreset].samples;
+	block.sourceSamplePosition = v->sourceSamplePosition;
+	block.sampleEnd = TSF_PHASE_FROM_INDEX(region->end);
+	block.loopStart = v->loopStart;
+	block.loopEnd = v->loopEnd;
+	block.lowpass = v->lowpass;
+
+	// Kernels for the interpolation, looping and output mode of this voice, the filtered variants follow 3 entries later
+	kernels = tsf_voice_block_kernels + ((f->interpolation * 2 + isLooping) * 2) * 3 + f->outputmode;
+
 	while (numSamples)
 	{
-		float gainMono, gainLeft, gainRight;
+		float gainMono;
 		int blockSamples = (numSamples > TSF_RENDER_EFFECTSAMPLEBLOCK ? TSF_RENDER_EFFECTSAMPLEBLOCK : numSamples);
 		numSamples -= blockSamples;
 
@@ -1263,17 +2704,20 @@ static void tsf_voice_render(tsf* f, struct tsf_voice* v, float* outputBuffer, i
 		{
 			float fres = tmpInitialFilterFc + v->modlfo.level * tmpModLfoToFilterFc + v->modenv.level * tmpModEnvToFilterFc;
 			float lowpassFc = (fres <= 13500 ? tsf_cents2Hertz(fres) / tmpSampleRate : 1.0f);
-			tmpLowpass.active = (lowpassFc < 0.499f);
-			if (tmpLowpass.active) tsf_voice_lowpass_setup(&tmpLowpass, lowpassFc);
+			block.lowpass.active = (lowpassFc < 0.499f);
+			if (block.lowpass.active) tsf_voice_lowpass_setup(&block.lowpass, lowpassFc);
 		}
 
 		if (dynamicPitchRatio)
+		{
 			pitchRatio = tsf_timecents2Secsd(v->pitchInputTimecents + (v->modlfo.level * tmpModLfoToPitch + v->viblfo.level * tmpVibLfoToPitch + v->modenv.level * tmpModEnvToPitch)) * v->pitchOutputFactor;
+			block.pitchIncrement = TSF_PHASE_FROM_RATIO(pitchRatio);
+		}
 
 		if (dynamicGain)
 			noteGain = tsf_decibelsToGain(v->noteGainDB + (v->modlfo.level * tmpModLfoToVolume));
 
-		gainMono = noteGain * v->ampenv.level;
+		gainMono = noteGain * v->ampenv.level * TSF_SAMPLE_GAIN;
 
 		// Update EG.
 		tsf_voice_envelope_process(&v->ampenv, blockSamples, tmpSampleRate);
@@ -1283,90 +2727,46 @@ static void tsf_voice_render(tsf* f, struct tsf_voice* v, float* outputBuffer, i
 		if (updateModLFO) tsf_voice_lfo_process(&v->modlfo, blockSamples);
 		if (updateVibLFO) tsf_voice_lfo_process(&v->viblfo, blockSamples);
 
-		switch (f->outputmode)
-		{
-			case TSF_STEREO_INTERLEAVED:
-				gainLeft = gainMono * v->panFactorLeft, gainRight = gainMono * v->panFactorRight;
-				while (blockSamples-- && tmpSourceSamplePosition < tmpSampleEndDbl)
-				{
-					unsigned int pos = (unsigned int)tmpSourceSamplePosition, nextPos = (pos >= tmpLoopEnd && isLooping ? tmpLoopStart : pos + 1);
-
-					// Simple linear interpolation.
-					float alpha = (float)(tmpSourceSamplePosition - pos), val = (input[pos] * (1.0f - alpha) + input[nextPos] * alpha);
-
-					// Low-pass filter.
-					if (tmpLowpass.active) val = tsf_voice_lowpass_process(&tmpLowpass, val);
+		// Resample, filter and mix the block.
+		blockSamples = kernels[block.lowpass.active ? 3 : 0](&block, &outL, &outR, blockSamples, gainMono, v->panFactorLeft, v->panFactorRight);
 
-					*outL++ += val * gainLeft;
-					*outL++ += val * gainRight;
-
-					// Next sample.
-					tmpSourceSamplePosition += pitchRatio;
-					if (tmpSourceSamplePosition >= tmpLoopEndDbl && isLooping) tmpSourceSamplePosition -= (tmpLoopEnd - tmpLoopStart + 1.0);
-				}
-				break;
-
-			case TSF_STEREO_UNWEAVED:
-				gainLeft = gainMono * v->panFactorLeft, gainRight = gainMono * v->panFactorRight;
-				while (blockSamples-- && tmpSourceSamplePosition < tmpSampleEndDbl)
-				{
-					unsigned int pos = (unsigned int)tmpSourceSamplePosition, nextPos = (pos >= tmpLoopEnd && isLooping ? tmpLoopStart : pos + 1);
-
-					// Simple linear interpolation.
-					float alpha = (float)(tmpSourceSamplePosition - pos), val = (input[pos] * (1.0f - alpha) + input[nextPos] * alpha);
-
-					// Low-pass filter.
-					if (tmpLowpass.active) val = tsf_voice_lowpass_process(&tmpLowpass, val);
-
-					*outL++ += val * gainLeft;
-					*outR++ += val * gainRight;
-
-					// Next sample.
-					tmpSourceSamplePosition += pitchRatio;
-					if (tmpSourceSamplePosition >= tmpLoopEndDbl && isLooping) tmpSourceSamplePosition -= (tmpLoopEnd - tmpLoopStart + 1.0);
-				}
-				break;
-
-			case TSF_MONO:
-				while (blockSamples-- && tmpSourceSamplePosition < tmpSampleEndDbl)
-				{
-					unsigned int pos = (unsigned int)tmpSourceSamplePosition, nextPos = (pos >= tmpLoopEnd && isLooping ? tmpLoopStart : pos + 1);
-
-					// Simple linear interpolation.
-					float alpha = (float)(tmpSourceSamplePosition - pos), val = (input[pos] * (1.0f - alpha) + input[nextPos] * alpha);
-
-					// Low-pass filter.
-					if (tmpLowpass.active) val = tsf_voice_lowpass_process(&tmpLowpass, val);
-
-					*outL++ += val * gainMono;
-
-					// Next sample.
-					tmpSourceSamplePosition += pitchRatio;
-					if (tmpSourceSamplePosition >= tmpLoopEndDbl && isLooping) tmpSourceSamplePosition -= (tmpLoopEnd - tmpLoopStart + 1.0);
-				}
-				break;
-		}
-
-		if (tmpSourceSamplePosition >= tmpSampleEndDbl || v->ampenv.segment == TSF_SEGMENT_DONE)
+		if (block.sourceSamplePosition >= block.sampleEnd || v->ampenv.segment == TSF_SEGMENT_DONE
+			|| (v->ampenv.level * peakGain < f->silenceGain && v->ampenv.segment == TSF_SEGMENT_RELEASE))
 		{
-			tsf_voice_kill(v);
+			// Parallel workers can't modify the voice lists, the voice gets ended in tsf_render_parallel_end
+			if (f->renderParallel) v->ampenv.segment = TSF_SEGMENT_DONE;
+			else tsf_voice_kill(f, v);
 			return;
 		}
 	}
 
-	v->sourceSamplePosition = tmpSourceSamplePosition;
-	if (tmpLowpass.active || dynamicLowpass) v->lowpass = tmpLowpass;
+	v->sourceSamplePosition = block.sourceSamplePosition;
+	if (block.lowpass.active || dynamicLowpass) v->lowpass = block.lowpass;
 }
 
-TSFDEF tsf* tsf_load(struct tsf_stream* stream)
+static tsf* tsf_load_ex(struct tsf_stream* stream, const struct tsf_stream_memory* memory, TSF_BOOL isMapping, const struct tsf_allocator* allocator, void* lazyFile)
 {
 	tsf* res = TSF_NULL;
 	struct tsf_riffchunk chunkHead;
 	struct tsf_riffchunk chunkList;
 	struct tsf_hydra hydra;
 	void* rawBuffer = TSF_NULL;
-	float* floatBuffer = TSF_NULL;
+	tsf_u8* chunkBuffer = TSF_NULL;
+	unsigned int chunkBufferSize = 0;
+	tsf_sample* sampleBuffer = TSF_NULL;
+	const tsf_sample* mappedBuffer = TSF_NULL;
 	tsf_u32 smplCount = 0;
+	tsf_u64 lazySmplPos = 0;
+	TSF_BOOL isLazy = TSF_FALSE;
+	struct tsf_allocator a;
+	if (allocator) a = *allocator;
+	else TSF_MEMSET(&a, 0, sizeof(a));
+	#ifndef TSF_SAMPLES_SHORT
+	(void)isMapping;
+	#endif
+	#ifdef TSF_NO_STDIO
+	(void)lazyFile;
+	#endif
 
 	if (!tsf_riffchunk_read(TSF_NULL, &chunkHead, stream) || !TSF_FourCCEquals(chunkHead.id, "sfbk"))
 	{
@@ -1383,13 +2783,17 @@ TSFDEF tsf* tsf_load(struct tsf_stream* stream)
 		{
 			while (tsf_riffchunk_read(&chunkList, &chunk, stream))
 			{
+				// Each chunk is read with one call (or used in place when loading from memory) and decoded in one pass
 				#define HandleChunk(chunkName) (TSF_FourCCEquals(chunk.id, #chunkName) && !(chunk.size % chunkName##SizeInFile)) \
 					{ \
 						int num = chunk.size / chunkName##SizeInFile, i; \
+						const tsf_u8* data = tsf_hydra_chunk_data(&chunk, stream, memory, &chunkBuffer, &chunkBufferSize, &a); \
+						if (!data) goto out_of_memory; \
+						tsf_free(&a, hydra.chunkName##s); \
 						hydra.chunkName##Num = num; \
-						hydra.chunkName##s = (struct tsf_hydra_##chunkName*)TSF_MALLOC(num * sizeof(struct tsf_hydra_##chunkName)); \
+						hydra.chunkName##s = (struct tsf_hydra_##chunkName*)tsf_alloc(&a, num * sizeof(struct tsf_hydra_##chunkName)); \
 						if (!hydra.chunkName##s) goto out_of_memory; \
-						for (i = 0; i < num; ++i) tsf_hydra_read_##chunkName(&hydra.chunkName##s[i], stream); \
+						for (i = 0; i < num; ++i, data += chunkName##SizeInFile) tsf_hydra_decode_##chunkName(&hydra.chunkName##s[i], data); \
 					}
 				enum
 				{
@@ -1412,9 +2816,30 @@ TSFDEF tsf* tsf_load(struct tsf_stream* stream)
 						#ifdef STB_VORBIS_INCLUDE_STB_VORBIS_H
 						|| TSF_FourCCEquals(chunk.id, "smpo")
 						#endif
-					) && !rawBuffer && !floatBuffer && chunk.size >= sizeof(short))
+					) && !rawBuffer && !sampleBuffer && !mappedBuffer && !isLazy && chunk.size >= sizeof(short))
 				{
-					if (!tsf_load_samples(&rawBuffer, &floatBuffer, &smplCount, &chunk, stream)) goto out_of_memory;
+					#ifndef TSF_NO_STDIO
+					if (lazyFile && TSF_FourCCEquals(chunk.id, "smpl"))
+					{
+						// Only remember where the samples are, each preset reads its range when it is first used
+						lazySmplPos = tsf_file_tell((FILE*)lazyFile);
+						smplCount = chunk.size / (unsigned int)sizeof(short);
+						isLazy = TSF_TRUE;
+						stream->skip(stream->data, chunk.size);
+					}
+					else
+					#endif
+					#ifdef TSF_SAMPLES_SHORT
+					if (isMapping && TSF_FourCCEquals(chunk.id, "smpl") && !(memory->pos & 1))
+					{
+						// Use the sample data directly from the mapped file without copying it
+						mappedBuffer = (const tsf_sample*)(memory->buffer + memory->pos);
+						smplCount = chunk.size / (unsigned int)sizeof(short);
+						stream->skip(stream->data, chunk.size);
+					}
+					else
+					#endif
+					if (!tsf_load_samples(&rawBuffer, &sampleBuffer, &smplCount, &chunk, stream, &a)) goto out_of_memory;
 				}
 				else stream->skip(stream->data, chunk.size);
 			}
@@ -1425,99 +2850,258 @@ TSFDEF tsf* tsf_load(struct tsf_stream* stream)
 	{
 		//if (e) *e = TSF_INVALID_INCOMPLETE;
 	}
-	else if (!rawBuffer && !floatBuffer)
+	else if (!rawBuffer && !sampleBuffer && !mappedBuffer && !isLazy)
 	{
 		//if (e) *e = TSF_INVALID_NOSAMPLEDATA;
 	}
 	else
 	{
+		#if defined(STB_VORBIS_INCLUDE_STB_VORBIS_H) && !defined(TSF_NO_STDIO)
+		if (isLazy)
+		{
+			// Compressed samples cannot be read for each preset separately, load all of them now
+			int i;
+			for (i = 0; i != hydra.shdrNum; i++) if (hydra.shdrs[i].sampleType & 0x30) break;
+			if (i != hydra.shdrNum)
+			{
+				struct tsf_riffchunk chunk;
+				TSF_MEMCPY(chunk.id, "smpl", 4);
+				chunk.size = smplCount * (tsf_u32)sizeof(short);
+				if (tsf_file_seek((FILE*)lazyFile, lazySmplPos) || !tsf_load_samples(&rawBuffer, &sampleBuffer, &smplCount, &chunk, stream, &a)) goto out_of_memory;
+				isLazy = TSF_FALSE;
+			}
+		}
+		#endif
 		#ifdef STB_VORBIS_INCLUDE_STB_VORBIS_H
-		if (!floatBuffer && !tsf_decode_sf3_samples(rawBuffer, &floatBuffer, &smplCount, &hydra)) goto out_of_memory;
+		if (mappedBuffer)
+		{
+			// Compressed samples in a mapped file still need to be decoded into memory
+			int i;
+			for (i = 0; i != hydra.shdrNum; i++) if (hydra.shdrs[i].sampleType & 0x30) break;
+			if (i != hydra.shdrNum)
+			{
+				smplCount *= (tsf_u32)sizeof(short);
+				if (!tsf_decode_sf3_samples(mappedBuffer, &sampleBuffer, &smplCount, &hydra, &a)) goto out_of_memory;
+				mappedBuffer = TSF_NULL;
+			}
+		}
+		if (!sampleBuffer && !mappedBuffer && !isLazy && !tsf_decode_sf3_samples(rawBuffer, &sampleBuffer, &smplCount, &hydra, &a)) goto out_of_memory;
 		#endif
-		res = (tsf*)TSF_MALLOC(sizeof(tsf));
+		res = (tsf*)tsf_alloc(&a, sizeof(tsf));
 		if (res) TSF_MEMSET(res, 0, sizeof(tsf));
-		if (!res || !tsf_load_presets(res, &hydra, smplCount)) goto out_of_memory;
+		if (!res || !(res->font = (struct tsf_font*)tsf_alloc(&a, sizeof(struct tsf_font)))) goto out_of_memory;
+		TSF_MEMSET(res->font, 0, sizeof(struct tsf_font));
+		res->font->allocator = a;
+		if (!tsf_load_presets(res->font, &hydra, smplCount)) goto out_of_memory;
+		res->font->refCount = 1;
 		res->outSampleRate = 44100.0f;
-		res->fontSamples = floatBuffer;
-		floatBuffer = TSF_NULL; // don't free below
+		res->voiceFreeHead = -1;
+		if (mappedBuffer)
+		{
+			res->font->samples = (tsf_sample*)mappedBuffer;
+			res->font->mapping = (void*)memory->buffer;
+			res->font->mappingSize = memory->total;
+		}
+		else res->font->samples = sampleBuffer;
+		sampleBuffer = TSF_NULL; // don't free below
+		if (isLazy)
+		{
+			res->font->lazyFile = lazyFile;
+			res->font->lazySmplPos = lazySmplPos;
+			res->font->smplCount = smplCount;
+		}
+		tsf_load_lazy_spans(res->font);
 	}
 	if (0)
 	{
 		out_of_memory:
-		TSF_FREE(res);
+		if (res) tsf_free(&a, res->font);
+		tsf_free(&a, res);
 		res = TSF_NULL;
 		//if (e) *e = TSF_OUT_OF_MEMORY;
 	}
-	TSF_FREE(hydra.phdrs); TSF_FREE(hydra.pbags); TSF_FREE(hydra.pmods);
-	TSF_FREE(hydra.pgens); TSF_FREE(hydra.insts); TSF_FREE(hydra.ibags);
-	TSF_FREE(hydra.imods); TSF_FREE(hydra.igens); TSF_FREE(hydra.shdrs);
-	TSF_FREE(rawBuffer);   TSF_FREE(floatBuffer);
+	tsf_free(&a, hydra.phdrs); tsf_free(&a, hydra.pbags); tsf_free(&a, hydra.pmods);
+	tsf_free(&a, hydra.pgens); tsf_free(&a, hydra.insts); tsf_free(&a, hydra.ibags);
+	tsf_free(&a, hydra.imods); tsf_free(&a, hydra.igens); tsf_free(&a, hydra.shdrs);
+	tsf_free(&a, rawBuffer);   tsf_free(&a, sampleBuffer);
+	tsf_free(&a, chunkBuffer);
 	return res;
 }
 
+TSFDEF tsf* tsf_load(struct tsf_stream* stream)
+{
+	return tsf_load_ex(stream, TSF_NULL, TSF_FALSE, TSF_NULL, TSF_NULL);
+}
+
+TSFDEF tsf* tsf_load_allocator(struct tsf_stream* stream, const struct tsf_allocator* allocator)
+{
+	return tsf_load_ex(stream, TSF_NULL, TSF_FALSE, allocator, TSF_NULL);
+}
+
 TSFDEF tsf* tsf_copy(tsf* f)
 {
 	tsf* res;
 	if (!f) return TSF_NULL;
-	if (!f->refCount)
-	{
-		f->refCount = (int*)TSF_MALLOC(sizeof(int));
-		if (!f->refCount) return TSF_NULL;
-		*f->refCount = 1;
-	}
-	res = (tsf*)TSF_MALLOC(sizeof(tsf));
+	res = (tsf*)tsf_alloc(&f->font->allocator, sizeof(tsf));
 	if (!res) return TSF_NULL;
-	TSF_MEMCPY(res, f, sizeof(tsf));
-	res->voices = TSF_NULL;
-	res->voiceNum = 0;
-	res->channels = TSF_NULL;
-	(*res->refCount)++;
+	TSF_MEMSET(res, 0, sizeof(tsf));
+	res->font = f->font;
+	res->voiceFreeHead = -1;
+	res->outputmode = f->outputmode;
+	res->outSampleRate = f->outSampleRate;
+	res->globalGainDB = f->globalGainDB;
+	res->silenceGain = f->silenceGain;
+	res->voiceSteal = f->voiceSteal;
+	res->renderClock = f->renderClock;
+	res->renderMaxLoad = f->renderMaxLoad;
+	if (!tsf_set_interpolation(res, f->interpolation)) { tsf_free(&f->font->allocator, res); return TSF_NULL; }
+	TSF_ATOMIC_ADD(&res->font->refCount, 1);
+	return res;
+}
+
+TSFDEF tsf* tsf_create_queue(tsf* f, int max_events)
+{
+	tsf* res;
+	struct tsf_queue* q;
+	unsigned int size = 2;
+	if (!f || f->queueReceive || f->queueSend) return TSF_NULL;
+	while (size < (unsigned int)max_events && size < 0x1000000) size <<= 1;
+	q = (struct tsf_queue*)tsf_alloc(&f->font->allocator, sizeof(struct tsf_queue) + sizeof(struct tsf_event) * (size - 1));
+	if (!q) return TSF_NULL;
+	// The handle only forwards events, it shares the font but gets none of the render state of tsf_copy
+	res = (tsf*)tsf_alloc(&f->font->allocator, sizeof(tsf));
+	if (!res) { tsf_free(&f->font->allocator, q); return TSF_NULL; }
+	TSF_MEMSET(res, 0, sizeof(tsf));
+	res->font = f->font;
+	res->voiceFreeHead = -1;
+	TSF_ATOMIC_ADD(&res->font->refCount, 1);
+	q->writePos = q->readPos = 0;
+	q->mask = size - 1;
+	res->queueSend = f->queueReceive = q;
 	return res;
 }
 
+static int tsf_queue_push(struct tsf_queue* q, int type, int channel, int param1, int param2, float value)
+{
+	unsigned int writePos = q->writePos;
+	struct tsf_event* e;
+	if (writePos - TSF_ATOMIC_LOAD(&q->readPos) > q->mask) return 0; // queue is full
+	e = &q->events[writePos & q->mask];
+	e->offset = 0;
+	e->type = type;
+	e->channel = channel;
+	e->param1 = param1;
+	e->param2 = param2;
+	e->value = value;
+	TSF_ATOMIC_STORE(&q->writePos, writePos + 1);
+	return 1;
+}
+
+static void tsf_event_apply(tsf* f, const struct tsf_event* e)
+{
+	switch (e->type)
+	{
+		case TSF_EVENT_NOTE_ON:                  tsf_note_on(f, e->param1, e->param2, e->value); break;
+		case TSF_EVENT_NOTE_OFF:                 tsf_note_off(f, e->param1, e->param2); break;
+		case TSF_EVENT_NOTE_OFF_ALL:             tsf_note_off_all(f); break;
+		case TSF_EVENT_RESET:                    tsf_reset(f); break;
+		case TSF_EVENT_CHANNEL_PRESETINDEX:      tsf_channel_set_presetindex(f, e->channel, e->param1); break;
+		case TSF_EVENT_CHANNEL_PRESETNUMBER:     tsf_channel_set_presetnumber(f, e->channel, e->param1, e->param2); break;
+		case TSF_EVENT_CHANNEL_BANK:             tsf_channel_set_bank(f, e->channel, e->param1); break;
+		case TSF_EVENT_CHANNEL_BANK_PRESET:      tsf_channel_set_bank_preset(f, e->channel, e->param1, e->param2); break;
+		case TSF_EVENT_CHANNEL_PAN:              tsf_channel_set_pan(f, e->channel, e->value); break;
+		case TSF_EVENT_CHANNEL_VOLUME:           tsf_channel_set_volume(f, e->channel, e->value); break;
+		case TSF_EVENT_CHANNEL_PITCHWHEEL:       tsf_channel_set_pitchwheel(f, e->channel, e->param1); break;
+		case TSF_EVENT_CHANNEL_PITCHRANGE:       tsf_channel_set_pitchrange(f, e->channel, e->value); break;
+		case TSF_EVENT_CHANNEL_TUNING:           tsf_channel_set_tuning(f, e->channel, e->value); break;
+		case TSF_EVENT_CHANNEL_SUSTAIN:          tsf_channel_set_sustain(f, e->channel, e->param1); break;
+		case TSF_EVENT_CHANNEL_NOTE_ON:          tsf_channel_note_on(f, e->channel, e->param1, e->value); break;
+		case TSF_EVENT_CHANNEL_NOTE_OFF:         tsf_channel_note_off(f, e->channel, e->param1); break;
+		case TSF_EVENT_CHANNEL_NOTE_OFF_ALL:     tsf_channel_note_off_all(f, e->channel); break;
+		case TSF_EVENT_CHANNEL_SOUNDS_OFF_ALL:   tsf_channel_sounds_off_all(f, e->channel); break;
+		case TSF_EVENT_CHANNEL_MIDI_CONTROL:     tsf_channel_midi_control(f, e->channel, e->param1, e->param2); break;
+		case TSF_EVENT_CHANNEL_PRIORITY:         tsf_channel_set_priority(f, e->channel, e->param1); break;
+	}
+}
+
+static void tsf_queue_apply(tsf* f)
+{
+	struct tsf_queue* q = f->queueReceive;
+	unsigned int readPos = q->readPos, writePos = TSF_ATOMIC_LOAD(&q->writePos);
+	for (; readPos != writePos; readPos++)
+		tsf_event_apply(f, &q->events[readPos & q->mask]);
+	TSF_ATOMIC_STORE(&q->readPos, readPos);
+}
+
 TSFDEF void tsf_close(tsf* f)
 {
+	struct tsf_allocator a;
 	if (!f) return;
-	if (!f->refCount || !--(*f->refCount))
+	a = f->font->allocator; // copied because the font might get freed first
+	if (TSF_ATOMIC_ADD(&f->font->refCount, (unsigned int)-1) == 1)
 	{
-		struct tsf_preset *preset = f->presets, *presetEnd = preset + f->presetNum;
-		for (; preset != presetEnd; preset++) TSF_FREE(preset->regions);
-		TSF_FREE(f->presets);
-		TSF_FREE(f->fontSamples);
-		TSF_FREE(f->refCount);
+		// This was the last tsf instance using the font
+		struct tsf_font* font = f->font;
+		#ifndef TSF_NO_STDIO
+		if (font->lazyFile)
+		{
+			int i;
+			for (i = 0; i != font->presetNum; i++) tsf_free(&a, font->presets[i].samples);
+			fclose((FILE*)font->lazyFile);
+		}
+		#endif
+		tsf_free(&a, font->regions); // also holds the presets
+		#ifdef TSF_MMAP
+		if (font->mapping) tsf_unmap(font->mapping, font->mappingSize);
+		else
+		#endif
+		tsf_free(&a, font->samples);
+		tsf_free(&a, font);
 	}
-	TSF_FREE(f->channels);
-	TSF_FREE(f->voices);
-	TSF_FREE(f);
+	tsf_free(&a, f->channels);
+	tsf_free(&a, f->voices);
+	tsf_free(&a, f->activeVoices);
+	tsf_free(&a, f->queueReceive);
+	tsf_free(&a, f->sincTable);
+	tsf_free(&a, f);
 }
 
 TSFDEF void tsf_reset(tsf* f)
 {
-	struct tsf_voice *v = f->voices, *vEnd = v + f->voiceNum;
-	for (; v != vEnd; v++)
-		if (v->playingPreset != -1 && (v->ampenv.segment < TSF_SEGMENT_RELEASE || v->ampenv.parameters.release))
+	int *active = f->activeVoices, *activeEnd = active + f->activeVoiceNum, i;
+	if (f->queueSend) { tsf_queue_push(f->queueSend, TSF_EVENT_RESET, 0, 0, 0, 0); return; }
+	for (; active != activeEnd; active++)
+	{
+		struct tsf_voice* v = &f->voices[*active];
+		if (v->ampenv.segment < TSF_SEGMENT_RELEASE || v->ampenv.parameters.release)
 			tsf_voice_endquick(f, v);
-	if (f->channels) { TSF_FREE(f->channels); f->channels = TSF_NULL; }
+	}
+	for (i = 0; i != f->voiceNum; i++) f->voices[i].keyChannel = -1;
+	if (f->channels) { tsf_free(&f->font->allocator, f->channels); f->channels = TSF_NULL; }
 }
 
 TSFDEF int tsf_get_presetindex(const tsf* f, int bank, int preset_number)
 {
-	const struct tsf_preset *presets;
-	int i, iMax;
-	for (presets = f->presets, i = 0, iMax = f->presetNum; i < iMax; i++)
-		if (presets[i].preset == preset_number && presets[i].bank == bank)
-			return i;
-	return -1;
+	// Presets are sorted by bank and preset number in tsf_load_presets, binary search for the first match
+	const struct tsf_preset *presets = f->font->presets;
+	int lo = 0, hi = f->font->presetNum;
+	while (lo < hi)
+	{
+		int mid = (lo + hi) >> 1;
+		if (presets[mid].bank < bank || (presets[mid].bank == bank && presets[mid].preset < preset_number)) lo = mid + 1;
+		else hi = mid;
+	}
+	return (lo < f->font->presetNum && presets[lo].bank == bank && presets[lo].preset == preset_number ? lo : -1);
 }
 
 TSFDEF int tsf_get_presetcount(const tsf* f)
 {
-	return f->presetNum;
+	return f->font->presetNum;
 }
 
 TSFDEF const char* tsf_get_presetname(const tsf* f, int preset)
 {
-	return (preset < 0 || preset >= f->presetNum ? TSF_NULL : f->presets[preset].presetName);
+	return (preset < 0 || preset >= f->font->presetNum ? TSF_NULL : f->font->presets[preset].presetName);
 }
 
 TSFDEF const char* tsf_bank_get_presetname(const tsf* f, int bank, int preset_number)
@@ -1541,82 +3125,126 @@ TSFDEF int tsf_set_max_voices(tsf* f, int max_voices)
 {
 	int i = f->voiceNum;
 	int newVoiceNum = (f->voiceNum > max_voices ? f->voiceNum : max_voices);
-	struct tsf_voice *newVoices = (struct tsf_voice*)TSF_REALLOC(f->voices, newVoiceNum * sizeof(struct tsf_voice));
-	if (!newVoices) return 0;
-	f->voices = newVoices;
-	f->voiceNum = f->maxVoiceNum = newVoiceNum;
-	for (; i < max_voices; i++)
-		f->voices[i].playingPreset = -1;
+	if (!tsf_voice_resize(f, newVoiceNum)) return 0;
+	f->maxVoiceNum = newVoiceNum;
+	tsf_voice_addfree(f, i, newVoiceNum);
 	return 1;
 }
 
-TSFDEF int tsf_note_on(tsf* f, int preset_index, int key, float vel)
+TSFDEF void tsf_set_silence_threshold(tsf* f, float threshold_db)
+{
+	f->silenceGain = (threshold_db < 0 ? tsf_decibelsToGain(threshold_db) : 0.0f);
+}
+
+TSFDEF void tsf_set_voice_stealing(tsf* f, enum TSFVoiceSteal policy)
+{
+	f->voiceSteal = policy;
+}
+
+TSFDEF void tsf_set_render_budget(tsf* f, double (*clock)(void), float max_load)
+{
+	f->renderClock = clock;
+	f->renderMaxLoad = max_load;
+	f->renderVoiceLimit = 0;
+	f->voiceSampleCost = 0;
+}
+
+TSFDEF int tsf_set_interpolation(tsf* f, enum TSFInterpolation interpolation)
+{
+	if (interpolation == TSF_INTERPOLATION_SINC && !f->sincTable)
+	{
+		// Blackman windowed sinc with a cutoff slightly below the source Nyquist frequency, one row for each fractional
+		// position from 0 to 1 (plus one more to interpolate towards from the last row) normalized to unity gain
+		int row, k;
+		f->sincTable = (float*)tsf_alloc(&f->font->allocator, (TSF_SINC_PHASES + 2) * 8 * sizeof(float));
+		if (!f->sincTable) return 0;
+		for (row = 0; row != TSF_SINC_PHASES + 2; row++)
+		{
+			float* coefs = f->sincTable + row * 8;
+			double sum = 0;
+			for (k = 0; k != 8; k++)
+			{
+				double t = (k - 3) - (double)row / TSF_SINC_PHASES, x = TSF_PI * 0.9 * t, w = t / 4.0;
+				double window = (w <= -1.0 || w >= 1.0 ? 0.0 : 0.42 + 0.5 * TSF_COS(TSF_PI * w) + 0.08 * TSF_COS(2.0 * TSF_PI * w));
+				coefs[k] = (float)((x ? TSF_COS(x - TSF_PI * 0.5) / x : 1.0) * window); // sin(x) / x
+				sum += coefs[k];
+			}
+			for (k = 0; k != 8; k++) coefs[k] = (float)(coefs[k] / sum);
+		}
+	}
+	f->interpolation = interpolation;
+	return 1;
+}
+
+static int tsf_note_on_channel(tsf* f, int preset_index, int key, float vel, int channel)
 {
 	short midiVelocity = (short)(vel * 127);
 	unsigned int voicePlayIndex;
-	struct tsf_region *region, *regionEnd;
+	struct tsf_preset* preset;
+	const int *keyRegion, *keyRegionEnd;
 
-	if (preset_index < 0 || preset_index >= f->presetNum) return 1;
+	if (preset_index < 0 || preset_index >= f->font->presetNum) return 1;
 	if (vel <= 0.0f) { tsf_note_off(f, preset_index, key); return 1; }
+	if (key < 0 || key > 127) return 1;
+	preset = &f->font->presets[preset_index];
+	if (f->font->lazyFile && !tsf_lazy_preset_ready(f, preset_index, TSF_FALSE)) return 0;
 
 	// Play all matching regions.
 	voicePlayIndex = f->voicePlayIndex++;
-	for (region = f->presets[preset_index].regions, regionEnd = region + f->presets[preset_index].regionNum; region != regionEnd; region++)
+	for (keyRegion = preset->keyRegions + preset->keyRegions[key], keyRegionEnd = preset->keyRegions + preset->keyRegions[key + 1]; keyRegion != keyRegionEnd; keyRegion++)
 	{
-		struct tsf_voice *voice, *v, *vEnd; TSF_BOOL doLoop; float lowpassFilterQDB, lowpassFc;
-		if (key < region->lokey || key > region->hikey || midiVelocity < region->lovel || midiVelocity > region->hivel) continue;
+		struct tsf_region *region = &preset->regions[*keyRegion];
+		struct tsf_voice *voice; int *active, *activeEnd; TSF_BOOL doLoop; float lowpassFc;
+		if (midiVelocity < region->lovel || midiVelocity > region->hivel) continue;
 
-		voice = TSF_NULL, v = f->voices, vEnd = v + f->voiceNum;
 		if (region->group)
 		{
-			for (; v != vEnd; v++)
+			for (active = f->activeVoices, activeEnd = active + f->activeVoiceNum; active != activeEnd; active++)
+			{
+				struct tsf_voice* v = &f->voices[*active];
 				if (v->playingPreset == preset_index && v->region->group == region->group) tsf_voice_endquick(f, v);
-				else if (v->playingPreset == -1 && !voice) voice = v;
+			}
 		}
-		else for (; v != vEnd; v++) if (v->playingPreset == -1) { voice = v; break; }
+		// Take over a playing voice instead of starting another one if the render budget is used up
+		voice = (f->renderVoiceLimit && f->activeVoiceNum >= f->renderVoiceLimit ? TSF_NULL : tsf_voice_alloc(f));
 
 		if (!voice)
 		{
-			if (f->maxVoiceNum)
+			if (f->maxVoiceNum || (f->renderVoiceLimit && f->activeVoiceNum >= f->renderVoiceLimit))
 			{
-				// Voices have been pre-allocated and limited to a maximum, try to kill a voice off in its release envelope
-				int bestKillReleaseSamplePos = -999999999;
-				for (v = f->voices; v != vEnd; v++)
-				{
-					if (v->ampenv.segment == TSF_SEGMENT_RELEASE)
-					{
-						// We're looking for the voice furthest into its release
-						int releaseSamplesDone = tsf_voice_envelope_release_samples(&v->ampenv, f->outSampleRate) - v->ampenv.samplesUntilNextSegment;
-						if (releaseSamplesDone > bestKillReleaseSamplePos)
-						{
-							bestKillReleaseSamplePos = releaseSamplesDone;
-							voice = v;
-						}
-					}
-				}
+				// Voices are limited to a pre-allocated maximum or by the render budget, try to steal one according to the policy
+				voice = tsf_voice_steal(f, f->voiceSteal, preset_index, key, channel, TSF_FALSE);
+				// Over the render budget the note still gets played by taking over the quietest voice
+				if (!voice && f->renderVoiceLimit && f->activeVoiceNum >= f->renderVoiceLimit)
+					voice = tsf_voice_steal(f, TSF_STEAL_QUIETEST, preset_index, key, channel, TSF_FALSE);
 				if (!voice)
 					continue;
-				tsf_voice_kill(voice);
 			}
 			else
 			{
-				// Allocate more voices so we don't need to kill one off.
-				struct tsf_voice* newVoices;
-				f->voiceNum += 4;
-				newVoices = (struct tsf_voice*)TSF_REALLOC(f->voices, f->voiceNum * sizeof(struct tsf_voice));
-				if (!newVoices) return 0;
-				f->voices = newVoices;
-				voice = &f->voices[f->voiceNum - 4];
-				voice[1].playingPreset = voice[2].playingPreset = voice[3].playingPreset = -1;
+				// Allocate more voices so we don't need to kill one off, grow geometrically
+				int oldVoiceNum = f->voiceNum;
+				if (!tsf_voice_resize(f, (oldVoiceNum ? oldVoiceNum * 2 : 8))) return 0;
+				tsf_voice_addfree(f, oldVoiceNum, f->voiceNum);
+				voice = tsf_voice_alloc(f);
 			}
 		}
 
+		if (voice->playingPreset == -1)
+		{
+			// Stolen voices are already in the active voice list
+			voice->activeIndex = f->activeVoiceNum;
+			f->activeVoices[f->activeVoiceNum++] = (int)(voice - f->voices);
+		}
+		if (voice->keyChannel != -1) tsf_voice_unlinkkey(f, voice);
+
 		voice->region = region;
 		voice->playingPreset = preset_index;
 		voice->playingKey = key;
 		voice->playIndex = voicePlayIndex;
 		voice->heldSustain = 0;
 		voice->noteGainDB = f->globalGainDB - region->attenuation - tsf_gainToDecibels(1.0f / vel);
+		voice->pitchOutputFactor = region->pitchOutputRate / f->outSampleRate;
 
 		if (f->channels)
 		{
@@ -1624,14 +3252,15 @@ TSFDEF int tsf_note_on(tsf* f, int preset_index, int key, float vel)
 		}
 		else
 		{
-			tsf_voice_calcpitchratio(voice, 0, f->outSampleRate);
+			voice->playingChannel = -1;
+			tsf_voice_calcpitchratio(voice, 0);
 			// The SFZ spec is silent about the pan curve, but a 3dB pan law seems common. This sqrt() curve matches what Dimension LE does; Alchemy Free seems closer to sin(adjustedPan * pi/2).
 			voice->panFactorLeft  = TSF_SQRTF(0.5f - region->pan);
 			voice->panFactorRight = TSF_SQRTF(0.5f + region->pan);
 		}
 
 		// Offset/end.
-		voice->sourceSamplePosition = region->offset;
+		voice->sourceSamplePosition = TSF_PHASE_FROM_INDEX(region->offset);
 
 		// Loop.
 		doLoop = (region->loop_mode != TSF_LOOPMODE_NONE && region->loop_start < region->loop_end);
@@ -1643,20 +3272,25 @@ TSFDEF int tsf_note_on(tsf* f, int preset_index, int key, float vel)
 		tsf_voice_envelope_setup(&voice->modenv, &region->modenv, key, midiVelocity, TSF_FALSE, f->outSampleRate);
 
 		// Setup lowpass filter.
-		lowpassFc = (region->initialFilterFc <= 13500 ? tsf_cents2Hertz((float)region->initialFilterFc) / f->outSampleRate : 1.0f);
-		lowpassFilterQDB = region->initialFilterQ / 10.0f;
-		voice->lowpass.QInv = 1.0 / TSF_POW(10.0, (lowpassFilterQDB / 20.0));
+		lowpassFc = (region->initialFilterFc <= 13500 ? region->lowpassFcHertz / f->outSampleRate : 1.0f);
+		voice->lowpass.QInv = region->lowpassQInv;
 		voice->lowpass.z1 = voice->lowpass.z2 = 0;
 		voice->lowpass.active = (lowpassFc < 0.499f);
 		if (voice->lowpass.active) tsf_voice_lowpass_setup(&voice->lowpass, lowpassFc);
 
 		// Setup LFO filters.
-		tsf_voice_lfo_setup(&voice->modlfo, region->delayModLFO, region->freqModLFO, f->outSampleRate);
-		tsf_voice_lfo_setup(&voice->viblfo, region->delayVibLFO, region->freqVibLFO, f->outSampleRate);
+		tsf_voice_lfo_setup(&voice->modlfo, region->delayModLFO, region->modLfoRate, f->outSampleRate);
+		tsf_voice_lfo_setup(&voice->viblfo, region->delayVibLFO, region->vibLfoRate, f->outSampleRate);
 	}
 	return 1;
 }
 
+TSFDEF int tsf_note_on(tsf* f, int preset_index, int key, float vel)
+{
+	if (f->queueSend) return tsf_queue_push(f->queueSend, TSF_EVENT_NOTE_ON, 0, preset_index, key, vel);
+	return tsf_note_on_channel(f, preset_index, key, vel, -1);
+}
+
 TSFDEF int tsf_bank_note_on(tsf* f, int bank, int preset_number, int key, float vel)
 {
 	int preset_index = tsf_get_presetindex(f, bank, preset_number);
@@ -1666,20 +3300,22 @@ TSFDEF int tsf_bank_note_on(tsf* f, int bank, int preset_number, int key, float
 
 TSFDEF void tsf_note_off(tsf* f, int preset_index, int key)
 {
-	struct tsf_voice *v = f->voices, *vEnd = v + f->voiceNum, *vMatchFirst = TSF_NULL, *vMatchLast = TSF_NULL;
-	for (; v != vEnd; v++)
+	int *active, *activeEnd = f->activeVoices + f->activeVoiceNum;
+	struct tsf_voice *v, *vMatch = TSF_NULL;
+	if (f->queueSend) { tsf_queue_push(f->queueSend, TSF_EVENT_NOTE_OFF, 0, preset_index, key, 0); return; }
+	for (active = f->activeVoices; active != activeEnd; active++)
 	{
-		//Find the first and last entry in the voices list with matching preset, key and look up the smallest play index
+		//Find the active voice with matching preset, key and the smallest play index
+		v = &f->voices[*active];
 		if (v->playingPreset != preset_index || v->playingKey != key || v->ampenv.segment >= TSF_SEGMENT_RELEASE) continue;
-		else if (!vMatchFirst || v->playIndex < vMatchFirst->playIndex) vMatchFirst = vMatchLast = v;
-		else if (v->playIndex == vMatchFirst->playIndex) vMatchLast = v;
+		if (!vMatch || v->playIndex < vMatch->playIndex) vMatch = v;
 	}
-	if (!vMatchFirst) return;
-	for (v = vMatchFirst; v <= vMatchLast; v++)
+	if (!vMatch) return;
+	for (active = f->activeVoices; active != activeEnd; active++)
 	{
 		//Stop all voices with matching preset, key and the smallest play index which was enumerated above
-		if (v != vMatchFirst && v != vMatchLast &&
-			(v->playIndex != vMatchFirst->playIndex || v->playingPreset != preset_index || v->playingKey != key || v->ampenv.segment >= TSF_SEGMENT_RELEASE)) continue;
+		v = &f->voices[*active];
+		if (v->playIndex != vMatch->playIndex || v->playingPreset != preset_index || v->playingKey != key || v->ampenv.segment >= TSF_SEGMENT_RELEASE) continue;
 		tsf_voice_end(f, v);
 	}
 }
@@ -1694,17 +3330,35 @@ TSFDEF int tsf_bank_note_off(tsf* f, int bank, int preset_number, int key)
 
 TSFDEF void tsf_note_off_all(tsf* f)
 {
-	struct tsf_voice *v = f->voices, *vEnd = v + f->voiceNum;
-	for (; v != vEnd; v++) if (v->playingPreset != -1 && v->ampenv.segment < TSF_SEGMENT_RELEASE)
-		tsf_voice_end(f, v);
+	int *active = f->activeVoices, *activeEnd = active + f->activeVoiceNum;
+	if (f->queueSend) { tsf_queue_push(f->queueSend, TSF_EVENT_NOTE_OFF_ALL, 0, 0, 0, 0); return; }
+	for (; active != activeEnd; active++) if (f->voices[*active].ampenv.segment < TSF_SEGMENT_RELEASE)
+		tsf_voice_end(f, &f->voices[*active]);
 }
 
 TSFDEF int tsf_active_voice_count(tsf* f)
 {
-	int count = 0;
-	struct tsf_voice *v = f->voices, *vEnd = v + f->voiceNum;
-	for (; v != vEnd; v++) if (v->playingPreset != -1) count++;
-	return count;
+	return f->activeVoiceNum;
+}
+
+TSFDEF int tsf_preload_preset(tsf* f, int preset_index)
+{
+	if (preset_index < 0 || preset_index >= f->font->presetNum) return 0;
+	return (f->font->lazyFile ? tsf_lazy_preset_ready(f, preset_index, TSF_TRUE) : 1);
+}
+
+TSFDEF void tsf_set_max_sample_memory(tsf* f, size_t max_bytes)
+{
+	#ifndef TSF_NO_STDIO
+	if (!f->font->lazyFile) return;
+	tsf_lazy_lock(&f->font->lazyLock);
+	f->font->maxResidentBytes = max_bytes;
+	TSF_ATOMIC_STORE(&f->font->lazyTrackUse, (max_bytes ? 1 : 0));
+	tsf_evict_preset_samples(f, 0);
+	tsf_lazy_unlock(&f->font->lazyLock);
+	#else
+	(void)f; (void)max_bytes;
+	#endif
 }
 
 TSFDEF void tsf_render_short(tsf* f, short* buffer, int samples, int flag_mixing)
@@ -1735,13 +3389,195 @@ TSFDEF void tsf_render_short(tsf* f, short* buffer, int samples, int flag_mixing
 	}
 }
 
+static void tsf_render_voices(tsf* f, float* outL, float* outR, int samples)
+{
+	// Iterate backwards because ending a voice moves the last active voice into its place
+	int i;
+	for (i = f->activeVoiceNum; i--;)
+		tsf_voice_render(f, &f->voices[f->activeVoices[i]], outL, outR, samples);
+}
+
+static void tsf_render_budget(tsf* f, double renderStart, int voices, int samples)
+{
+	int *active, *activeEnd, excess;
+	if (voices && samples > 0)
+	{
+		// Update the average cost of one voice sample and derive how many voices fit into the share of the buffer duration
+		double cost = (f->renderClock() - renderStart) / ((double)voices * samples), limit;
+		f->voiceSampleCost = (f->voiceSampleCost ? f->voiceSampleCost + (cost - f->voiceSampleCost) * 0.125 : cost);
+		limit = (f->voiceSampleCost > 0 ? f->renderMaxLoad / (f->voiceSampleCost * f->outSampleRate) : 0x7FFFFFFF);
+		f->renderVoiceLimit = (limit < 1 ? 1 : limit > 0x7FFFFFFF ? 0x7FFFFFFF : (int)limit);
+	}
+	if (!f->renderVoiceLimit) return;
+
+	// Fade out the voices over the limit which are not already ending quickly, picked by the stealing policy
+	for (excess = -f->renderVoiceLimit, active = f->activeVoices, activeEnd = active + f->activeVoiceNum; active != activeEnd; active++)
+		if (f->voices[*active].ampenv.segment < TSF_SEGMENT_RELEASE || f->voices[*active].ampenv.parameters.release > 0) excess++;
+	for (; excess > 0; excess--)
+	{
+		struct tsf_voice* v = tsf_voice_steal(f, f->voiceSteal, -1, -1, -1, TSF_TRUE);
+		if (!v) break;
+		tsf_voice_endquick(f, v);
+	}
+}
+
 TSFDEF void tsf_render_float(tsf* f, float* buffer, int samples, int flag_mixing)
 {
-	struct tsf_voice *v = f->voices, *vEnd = v + f->voiceNum;
+	double renderStart = 0;
+	int voices;
+	if (f->queueReceive) tsf_queue_apply(f);
+	if (f->renderClock) renderStart = f->renderClock();
+	voices = f->activeVoiceNum;
+	if (!flag_mixing) TSF_MEMSET(buffer, 0, (f->outputmode == TSF_MONO ? 1 : 2) * sizeof(float) * samples);
+	tsf_render_voices(f, buffer, (f->outputmode == TSF_STEREO_UNWEAVED ? buffer + samples : TSF_NULL), samples);
+	if (f->renderClock) tsf_render_budget(f, renderStart, voices, samples);
+}
+
+TSFDEF void tsf_render_float_events(tsf* f, float* buffer, int samples, const struct tsf_event* events, int event_count, int flag_mixing)
+{
+	int pos = 0, next, stride = (f->outputmode == TSF_STEREO_INTERLEAVED ? 2 : 1), voices = 0;
+	double renderStart = 0;
+	if (f->queueReceive) tsf_queue_apply(f);
+	if (f->renderClock) renderStart = f->renderClock();
 	if (!flag_mixing) TSF_MEMSET(buffer, 0, (f->outputmode == TSF_MONO ? 1 : 2) * sizeof(float) * samples);
-	for (; v != vEnd; v++)
-		if (v->playingPreset != -1)
-			tsf_voice_render(f, v, buffer, samples);
+	while (pos < samples)
+	{
+		// Apply all events up to the current position then render until the next event
+		for (; event_count && events->offset <= pos; events++, event_count--) tsf_event_apply(f, events);
+		next = (event_count && events->offset < samples ? events->offset : samples);
+		if (f->activeVoiceNum > voices) voices = f->activeVoiceNum;
+		tsf_render_voices(f, buffer + pos * stride, (f->outputmode == TSF_STEREO_UNWEAVED ? buffer + samples + pos : TSF_NULL), next - pos);
+		pos = next;
+	}
+	for (; event_count; events++, event_count--) tsf_event_apply(f, events);
+	if (f->renderClock) tsf_render_budget(f, renderStart, voices, samples);
+}
+
+TSFDEF void tsf_render_parallel_begin(tsf* f)
+{
+	if (f->queueReceive) tsf_queue_apply(f);
+	if (f->renderClock) f->renderParallelStart = f->renderClock();
+	f->renderNextVoice = 0;
+	f->renderParallel = 1;
+}
+
+TSFDEF void tsf_render_parallel_worker(tsf* f, float* worker_buffer, int samples)
+{
+	float* outR = (f->outputmode == TSF_STEREO_UNWEAVED ? worker_buffer + samples : TSF_NULL);
+	TSF_MEMSET(worker_buffer, 0, (f->outputmode == TSF_MONO ? 1 : 2) * sizeof(float) * samples);
+	for (;;)
+	{
+		// Take one voice at a time so workers that got cheap voices continue with the remaining ones
+		unsigned int i = TSF_ATOMIC_ADD(&f->renderNextVoice, 1);
+		if (i >= (unsigned int)f->activeVoiceNum) break;
+		tsf_voice_render(f, &f->voices[f->activeVoices[i]], worker_buffer, outR, samples);
+	}
+}
+
+TSFDEF void tsf_render_parallel_end(tsf* f, float* buffer, float* const* worker_buffers, int worker_count, int samples, int flag_mixing)
+{
+	int i, voices, count = (f->outputmode == TSF_MONO ? 1 : 2) * samples;
+	f->renderParallel = 0;
+	if (!flag_mixing) TSF_MEMSET(buffer, 0, sizeof(float) * count);
+	for (i = 0; i != worker_count; i++)
+		tsf_voice_mix_mono(buffer, worker_buffers[i], count, 1.0f);
+	voices = f->activeVoiceNum;
+	for (i = f->activeVoiceNum; i--;)
+		if (f->voices[f->activeVoices[i]].ampenv.segment == TSF_SEGMENT_DONE)
+			tsf_voice_kill(f, &f->voices[f->activeVoices[i]]);
+	// The budget is compared against the time all workers took together from begin to end
+	if (f->renderClock) tsf_render_budget(f, f->renderParallelStart, voices, samples);
+}
+
+struct tsf_scheduler_instance
+{
+	tsf* f;
+	float* buffer;
+	double renderTime, finishTime;
+	int overruns;
+};
+
+struct tsf_scheduler
+{
+	double (*clock)(void);
+	double periodStart, deadline;
+	int instanceNum, samples;
+	unsigned int nextInstance, doneInstances;
+	struct tsf_scheduler_instance instances[1];
+};
+
+TSFDEF tsf_scheduler* tsf_scheduler_create(tsf* const* instances, float* const* buffers, int instance_count, double (*clock)(void))
+{
+	int i;
+	tsf_scheduler* s = (tsf_scheduler*)TSF_MALLOC(sizeof(tsf_scheduler) + sizeof(struct tsf_scheduler_instance) * (instance_count > 1 ? instance_count - 1 : 0));
+	if (!s) return TSF_NULL;
+	s->clock = clock;
+	s->periodStart = s->deadline = 0;
+	s->instanceNum = instance_count;
+	s->samples = 0;
+	s->nextInstance = s->doneInstances = 0;
+	for (i = 0; i != instance_count; i++)
+	{
+		struct tsf_scheduler_instance* inst = &s->instances[i];
+		inst->f = instances[i];
+		inst->buffer = buffers[i];
+		inst->renderTime = inst->finishTime = 0;
+		inst->overruns = 0;
+	}
+	return s;
+}
+
+TSFDEF void tsf_scheduler_close(tsf_scheduler* s)
+{
+	TSF_FREE(s);
+}
+
+TSFDEF void tsf_scheduler_begin(tsf_scheduler* s, int samples, double deadline)
+{
+	s->samples = samples;
+	s->deadline = deadline;
+	s->periodStart = (s->clock ? s->clock() : 0);
+	s->doneInstances = 0;
+	TSF_ATOMIC_STORE(&s->nextInstance, 0);
+}
+
+TSFDEF int tsf_scheduler_worker(tsf_scheduler* s)
+{
+	int finishedPeriod = 0;
+	for (;;)
+	{
+		struct tsf_scheduler_instance* inst;
+		double renderStart;
+		unsigned int i = TSF_ATOMIC_ADD(&s->nextInstance, 1);
+		if (i >= (unsigned int)s->instanceNum) return finishedPeriod;
+		inst = &s->instances[i];
+		renderStart = (s->clock ? s->clock() : 0);
+		tsf_render_float(inst->f, inst->buffer, s->samples, 0);
+		if (s->clock)
+		{
+			double now = s->clock();
+			inst->renderTime = now - renderStart;
+			inst->finishTime = now - s->periodStart;
+			if (inst->finishTime > s->deadline) inst->overruns++;
+		}
+		// The worker which completes the last instance acts as the barrier for the period
+		if (TSF_ATOMIC_ADD(&s->doneInstances, 1) + 1 == (unsigned int)s->instanceNum) finishedPeriod = 1;
+	}
+}
+
+TSFDEF double tsf_scheduler_get_rendertime(const tsf_scheduler* s, int instance_index)
+{
+	return (instance_index >= 0 && instance_index < s->instanceNum ? s->instances[instance_index].renderTime : 0);
+}
+
+TSFDEF double tsf_scheduler_get_finishtime(const tsf_scheduler* s, int instance_index)
+{
+	return (instance_index >= 0 && instance_index < s->instanceNum ? s->instances[instance_index].finishTime : 0);
+}
+
+TSFDEF int tsf_scheduler_get_overruns(const tsf_scheduler* s, int instance_index)
+{
+	return (instance_index >= 0 && instance_index < s->instanceNum ? s->instances[instance_index].overruns : 0);
 }
 
 static void tsf_channel_setup_voice(tsf* f, struct tsf_voice* v)
@@ -1749,8 +3585,9 @@ static void tsf_channel_setup_voice(tsf* f, struct tsf_voice* v)
 	struct tsf_channel* c = &f->channels->channels[f->channels->activeChannel];
 	float newpan = v->region->pan + c->panOffset;
 	v->playingChannel = f->channels->activeChannel;
+	tsf_voice_linkkey(f, v, v->playingChannel);
 	v->noteGainDB += c->gainDB;
-	tsf_voice_calcpitchratio(v, (c->pitchWheel == 8192 ? c->tuning : ((c->pitchWheel / 16383.0f * c->pitchRange * 2.0f) - c->pitchRange + c->tuning)), f->outSampleRate);
+	tsf_voice_calcpitchratio(v, (c->pitchWheel == 8192 ? c->tuning : ((c->pitchWheel / 16383.0f * c->pitchRange * 2.0f) - c->pitchRange + c->tuning)));
 	if      (newpan <= -0.5f) { v->panFactorLeft = 1.0f; v->panFactorRight = 0.0f; }
 	else if (newpan >=  0.5f) { v->panFactorLeft = 0.0f; v->panFactorRight = 1.0f; }
 	else { v->panFactorLeft = TSF_SQRTF(0.5f - newpan); v->panFactorRight = TSF_SQRTF(0.5f + newpan); }
@@ -1762,7 +3599,7 @@ static struct tsf_channel* tsf_channel_init(tsf* f, int channel)
 	if (f->channels && channel < f->channels->channelNum) return &f->channels->channels[channel];
 	if (!f->channels)
 	{
-		f->channels = (struct tsf_channels*)TSF_MALLOC(sizeof(struct tsf_channels) + sizeof(struct tsf_channel) * channel);
+		f->channels = (struct tsf_channels*)tsf_alloc(&f->font->allocator, sizeof(struct tsf_channels) + sizeof(struct tsf_channel) * channel);
 		if (!f->channels) return TSF_NULL;
 		f->channels->setupVoice = &tsf_channel_setup_voice;
 		f->channels->channelNum = 0;
@@ -1770,7 +3607,7 @@ static struct tsf_channel* tsf_channel_init(tsf* f, int channel)
 	}
 	else
 	{
-		struct tsf_channels *newChannels = (struct tsf_channels*)TSF_REALLOC(f->channels, sizeof(struct tsf_channels) + sizeof(struct tsf_channel) * channel);
+		struct tsf_channels *newChannels = (struct tsf_channels*)tsf_realloc(&f->font->allocator, f->channels, sizeof(struct tsf_channels) + sizeof(struct tsf_channel) * channel);
 		if (!newChannels) return TSF_NULL;
 		f->channels = newChannels;
 	}
@@ -1779,6 +3616,8 @@ static struct tsf_channel* tsf_channel_init(tsf* f, int channel)
 	for (; i <= channel; i++)
 	{
 		struct tsf_channel* c = &f->channels->channels[i];
+		int key;
+		for (key = 0; key != 128; key++) c->keyVoices[key] = -1;
 		c->presetIndex = c->bank = 0;
 		c->pitchWheel = c->midiPan = 8192;
 		c->midiVolume = c->midiExpression = 16383;
@@ -1788,31 +3627,36 @@ static struct tsf_channel* tsf_channel_init(tsf* f, int channel)
 		c->gainDB = 0.0f;
 		c->pitchRange = 2.0f;
 		c->tuning = 0.0f;
+		c->priority = 0;
 	}
 	return &f->channels->channels[channel];
 }
 
 static void tsf_channel_applypitch(tsf* f, int channel, struct tsf_channel* c)
 {
-	struct tsf_voice *v, *vEnd;
+	int *active, *activeEnd;
 	float pitchShift = (c->pitchWheel == 8192 ? c->tuning : ((c->pitchWheel / 16383.0f * c->pitchRange * 2.0f) - c->pitchRange + c->tuning));
-	for (v = f->voices, vEnd = v + f->voiceNum; v != vEnd; v++)
-		if (v->playingPreset != -1 && v->playingChannel == channel)
-			tsf_voice_calcpitchratio(v, pitchShift, f->outSampleRate);
+	for (active = f->activeVoices, activeEnd = active + f->activeVoiceNum; active != activeEnd; active++)
+		if (f->voices[*active].playingChannel == channel)
+			tsf_voice_calcpitchratio(&f->voices[*active], pitchShift);
 }
 
 TSFDEF int tsf_channel_set_presetindex(tsf* f, int channel, int preset_index)
 {
-	struct tsf_channel *c = tsf_channel_init(f, channel);
+	struct tsf_channel *c;
+	if (f->queueSend) return tsf_queue_push(f->queueSend, TSF_EVENT_CHANNEL_PRESETINDEX, channel, preset_index, 0, 0);
+	c = tsf_channel_init(f, channel);
 	if (!c) return 0;
 	c->presetIndex = (unsigned short)preset_index;
-	return 1;
+	return (f->font->lazyFile ? tsf_lazy_preset_ready(f, preset_index, TSF_FALSE) : 1);
 }
 
 TSFDEF int tsf_channel_set_presetnumber(tsf* f, int channel, int preset_number, int flag_mididrums)
 {
 	int preset_index;
-	struct tsf_channel *c = tsf_channel_init(f, channel);
+	struct tsf_channel *c;
+	if (f->queueSend) return tsf_queue_push(f->queueSend, TSF_EVENT_CHANNEL_PRESETNUMBER, channel, preset_number, flag_mididrums, 0);
+	c = tsf_channel_init(f, channel);
 	if (!c) return 0;
 	if (flag_mididrums)
 	{
@@ -1826,14 +3670,16 @@ TSFDEF int tsf_channel_set_presetnumber(tsf* f, int channel, int preset_number,
 	if (preset_index != -1)
 	{
 		c->presetIndex = (unsigned short)preset_index;
-		return 1;
+		return (f->font->lazyFile ? tsf_lazy_preset_ready(f, preset_index, TSF_FALSE) : 1);
 	}
 	return 0;
 }
 
 TSFDEF int tsf_channel_set_bank(tsf* f, int channel, int bank)
 {
-	struct tsf_channel *c = tsf_channel_init(f, channel);
+	struct tsf_channel *c;
+	if (f->queueSend) return tsf_queue_push(f->queueSend, TSF_EVENT_CHANNEL_BANK, channel, bank, 0, 0);
+	c = tsf_channel_init(f, channel);
 	if (!c) return 0;
 	c->bank = (unsigned short)bank;
 	return 1;
@@ -1842,23 +3688,28 @@ TSFDEF int tsf_channel_set_bank(tsf* f, int channel, int bank)
 TSFDEF int tsf_channel_set_bank_preset(tsf* f, int channel, int bank, int preset_number)
 {
 	int preset_index;
-	struct tsf_channel *c = tsf_channel_init(f, channel);
+	struct tsf_channel *c;
+	if (f->queueSend) return tsf_queue_push(f->queueSend, TSF_EVENT_CHANNEL_BANK_PRESET, channel, bank, preset_number, 0);
+	c = tsf_channel_init(f, channel);
 	if (!c) return 0;
 	preset_index = tsf_get_presetindex(f, bank, preset_number);
 	if (preset_index == -1) return 0;
 	c->presetIndex = (unsigned short)preset_index;
 	c->bank = (unsigned short)bank;
-	return 1;
+	return (f->font->lazyFile ? tsf_lazy_preset_ready(f, preset_index, TSF_FALSE) : 1);
 }
 
 TSFDEF int tsf_channel_set_pan(tsf* f, int channel, float pan)
 {
-	struct tsf_voice *v, *vEnd;
-	struct tsf_channel *c = tsf_channel_init(f, channel);
+	int *active, *activeEnd;
+	struct tsf_channel *c;
+	if (f->queueSend) return tsf_queue_push(f->queueSend, TSF_EVENT_CHANNEL_PAN, channel, 0, 0, pan);
+	c = tsf_channel_init(f, channel);
 	if (!c) return 0;
-	for (v = f->voices, vEnd = v + f->voiceNum; v != vEnd; v++)
-		if (v->playingPreset != -1 && v->playingChannel == channel)
+	for (active = f->activeVoices, activeEnd = active + f->activeVoiceNum; active != activeEnd; active++)
+		if (f->voices[*active].playingChannel == channel)
 		{
+			struct tsf_voice* v = &f->voices[*active];
 			float newpan = v->region->pan + pan - 0.5f;
 			if      (newpan <= -0.5f) { v->panFactorLeft = 1.0f; v->panFactorRight = 0.0f; }
 			else if (newpan >=  0.5f) { v->panFactorLeft = 0.0f; v->panFactorRight = 1.0f; }
@@ -1871,20 +3722,24 @@ TSFDEF int tsf_channel_set_pan(tsf* f, int channel, float pan)
 TSFDEF int tsf_channel_set_volume(tsf* f, int channel, float volume)
 {
 	float gainDB = tsf_gainToDecibels(volume), gainDBChange;
-	struct tsf_voice *v, *vEnd;
-	struct tsf_channel *c = tsf_channel_init(f, channel);
+	int *active, *activeEnd;
+	struct tsf_channel *c;
+	if (f->queueSend) return tsf_queue_push(f->queueSend, TSF_EVENT_CHANNEL_VOLUME, channel, 0, 0, volume);
+	c = tsf_channel_init(f, channel);
 	if (!c) return 0;
 	if (gainDB == c->gainDB) return 1;
-	for (v = f->voices, vEnd = v + f->voiceNum, gainDBChange = gainDB - c->gainDB; v != vEnd; v++)
-		if (v->playingPreset != -1 && v->playingChannel == channel)
-			v->noteGainDB += gainDBChange;
+	for (active = f->activeVoices, activeEnd = active + f->activeVoiceNum, gainDBChange = gainDB - c->gainDB; active != activeEnd; active++)
+		if (f->voices[*active].playingChannel == channel)
+			f->voices[*active].noteGainDB += gainDBChange;
 	c->gainDB = gainDB;
 	return 1;
 }
 
 TSFDEF int tsf_channel_set_pitchwheel(tsf* f, int channel, int pitch_wheel)
 {
-	struct tsf_channel *c = tsf_channel_init(f, channel);
+	struct tsf_channel *c;
+	if (f->queueSend) return tsf_queue_push(f->queueSend, TSF_EVENT_CHANNEL_PITCHWHEEL, channel, pitch_wheel, 0, 0);
+	c = tsf_channel_init(f, channel);
 	if (!c) return 0;
 	if (c->pitchWheel == pitch_wheel) return 1;
 	c->pitchWheel = (unsigned short)pitch_wheel;
@@ -1894,7 +3749,9 @@ TSFDEF int tsf_channel_set_pitchwheel(tsf* f, int channel, int pitch_wheel)
 
 TSFDEF int tsf_channel_set_pitchrange(tsf* f, int channel, float pitch_range)
 {
-	struct tsf_channel *c = tsf_channel_init(f, channel);
+	struct tsf_channel *c;
+	if (f->queueSend) return tsf_queue_push(f->queueSend, TSF_EVENT_CHANNEL_PITCHRANGE, channel, 0, 0, pitch_range);
+	c = tsf_channel_init(f, channel);
 	if (!c) return 0;
 	if (c->pitchRange == pitch_range) return 1;
 	c->pitchRange = pitch_range;
@@ -1904,7 +3761,9 @@ TSFDEF int tsf_channel_set_pitchrange(tsf* f, int channel, float pitch_range)
 
 TSFDEF int tsf_channel_set_tuning(tsf* f, int channel, float tuning)
 {
-	struct tsf_channel *c = tsf_channel_init(f, channel);
+	struct tsf_channel *c;
+	if (f->queueSend) return tsf_queue_push(f->queueSend, TSF_EVENT_CHANNEL_TUNING, channel, 0, 0, tuning);
+	c = tsf_channel_init(f, channel);
 	if (!c) return 0;
 	if (c->tuning == tuning) return 1;
 	c->tuning = tuning;
@@ -1914,22 +3773,40 @@ TSFDEF int tsf_channel_set_tuning(tsf* f, int channel, float tuning)
 
 TSFDEF int tsf_channel_set_sustain(tsf* f, int channel, int flag_sustain)
 {
-	struct tsf_channel *c = tsf_channel_init(f, channel);
+	struct tsf_channel *c;
+	int key, i, next;
+	if (f->queueSend) return tsf_queue_push(f->queueSend, TSF_EVENT_CHANNEL_SUSTAIN, channel, flag_sustain, 0, 0);
+	c = tsf_channel_init(f, channel);
 	if (!c) return 0;
 	if (!c->sustain == !flag_sustain) return 1;
 	c->sustain = (unsigned short)(flag_sustain != 0);
 	//Turning on sustain does no action now, just starts note_off behaving differently
 	if (flag_sustain) return 1;
 	//Turning off sustain, actually end voices that got a note_off and were set to heldSustain status
-	struct tsf_voice *v = f->voices, *vEnd = v + f->voiceNum;
-	for (; v != vEnd; v++)
-		if (v->playingPreset != -1 && v->playingChannel == channel && v->ampenv.segment < TSF_SEGMENT_RELEASE && v->heldSustain)
-			tsf_voice_end(f, v);
+	for (key = 0; key != 128; key++)
+		for (i = c->keyVoices[key]; i != -1; i = next)
+		{
+			struct tsf_voice* v = &f->voices[i];
+			next = v->keyNext;
+			if (v->playingPreset == -1) tsf_voice_unlinkkey(f, v);
+			else if (v->ampenv.segment < TSF_SEGMENT_RELEASE && v->heldSustain) tsf_voice_end(f, v);
+		}
+	return 1;
+}
+
+TSFDEF int tsf_channel_set_priority(tsf* f, int channel, int priority)
+{
+	struct tsf_channel *c;
+	if (f->queueSend) return tsf_queue_push(f->queueSend, TSF_EVENT_CHANNEL_PRIORITY, channel, priority, 0, 0);
+	c = tsf_channel_init(f, channel);
+	if (!c) return 0;
+	c->priority = priority;
 	return 1;
 }
 
 TSFDEF int tsf_channel_note_on(tsf* f, int channel, int key, float vel)
 {
+	if (f->queueSend) return tsf_queue_push(f->queueSend, TSF_EVENT_CHANNEL_NOTE_ON, channel, key, 0, vel);
 	if (!f->channels || channel >= f->channels->channelNum) return 1;
 	f->channels->activeChannel = channel;
 	if (!vel)
@@ -1937,26 +3814,32 @@ TSFDEF int tsf_channel_note_on(tsf* f, int channel, int key, float vel)
 		tsf_channel_note_off(f, channel, key);
 		return 1;
 	}
-	return tsf_note_on(f, f->channels->channels[channel].presetIndex, key, vel);
+	return tsf_note_on_channel(f, f->channels->channels[channel].presetIndex, key, vel, channel);
 }
 
 TSFDEF void tsf_channel_note_off(tsf* f, int channel, int key)
 {
 	unsigned sustain;
-	struct tsf_voice *v = f->voices, *vEnd = v + f->voiceNum, *vMatchFirst = TSF_NULL, *vMatchLast = TSF_NULL;
-	for (; v != vEnd; v++)
+	int i, next;
+	struct tsf_voice *v, *vMatch = TSF_NULL;
+	if (f->queueSend) { tsf_queue_push(f->queueSend, TSF_EVENT_CHANNEL_NOTE_OFF, channel, key, 0, 0); return; }
+	if (!f->channels || channel < 0 || channel >= f->channels->channelNum || key < 0 || key > 127) return;
+	for (i = f->channels->channels[channel].keyVoices[key]; i != -1; i = next)
 	{
-		//Find the first and last entry in the voices list with matching channel, key and look up the smallest play index
-		if (v->playingPreset == -1 || v->playingChannel != channel || v->playingKey != key || v->ampenv.segment >= TSF_SEGMENT_RELEASE || v->heldSustain) continue;
-		else if (!vMatchFirst || v->playIndex < vMatchFirst->playIndex) vMatchFirst = vMatchLast = v;
-		else if (v->playIndex == vMatchFirst->playIndex) vMatchLast = v;
+		//Voices of the key are listed in start order, so the first matching voice has the smallest play index
+		v = &f->voices[i];
+		next = v->keyNext;
+		if (v->playingPreset == -1) tsf_voice_unlinkkey(f, v);
+		else if (v->ampenv.segment < TSF_SEGMENT_RELEASE && !v->heldSustain) { vMatch = v; break; }
 	}
-	if (!vMatchFirst) return;
-	for (sustain = f->channels->channels[channel].sustain, v = vMatchFirst; v <= vMatchLast; v++)
+	if (!vMatch) return;
+	for (sustain = f->channels->channels[channel].sustain, i = (int)(vMatch - f->voices); i != -1; i = next)
 	{
 		//Stop all voices with matching channel, key and the smallest play index which was enumerated above
-		if (v != vMatchFirst && v != vMatchLast &&
-			(v->playIndex != vMatchFirst->playIndex || v->playingPreset == -1 || v->playingChannel != channel || v->playingKey != key || v->ampenv.segment >= TSF_SEGMENT_RELEASE)) continue;
+		v = &f->voices[i];
+		next = v->keyNext;
+		if (v->playIndex != vMatch->playIndex) break;
+		if (v->playingPreset == -1 || v->ampenv.segment >= TSF_SEGMENT_RELEASE) continue;
 		//Don't turn off if sustain is active, just mark as held by sustain so we don't forget it
 		if (sustain)
 			v->heldSustain = 1;
@@ -1968,23 +3851,39 @@ TSFDEF void tsf_channel_note_off(tsf* f, int channel, int key)
 TSFDEF void tsf_channel_note_off_all(tsf* f, int channel)
 {
 	//Ignore sustain channel settings, note_off_all overrides
-	struct tsf_voice *v = f->voices, *vEnd = v + f->voiceNum;
-	for (; v != vEnd; v++)
-		if (v->playingPreset != -1 && v->playingChannel == channel && v->ampenv.segment < TSF_SEGMENT_RELEASE)
-			tsf_voice_end(f, v);
+	int key, i, next;
+	if (f->queueSend) { tsf_queue_push(f->queueSend, TSF_EVENT_CHANNEL_NOTE_OFF_ALL, channel, 0, 0, 0); return; }
+	if (!f->channels || channel < 0 || channel >= f->channels->channelNum) return;
+	for (key = 0; key != 128; key++)
+		for (i = f->channels->channels[channel].keyVoices[key]; i != -1; i = next)
+		{
+			struct tsf_voice* v = &f->voices[i];
+			next = v->keyNext;
+			if (v->playingPreset == -1) tsf_voice_unlinkkey(f, v);
+			else if (v->ampenv.segment < TSF_SEGMENT_RELEASE) tsf_voice_end(f, v);
+		}
 }
 
 TSFDEF void tsf_channel_sounds_off_all(tsf* f, int channel)
 {
-	struct tsf_voice *v = f->voices, *vEnd = v + f->voiceNum;
-	for (; v != vEnd; v++)
-		if (v->playingPreset != -1 && v->playingChannel == channel && (v->ampenv.segment < TSF_SEGMENT_RELEASE || v->ampenv.parameters.release))
-			tsf_voice_endquick(f, v);
+	int key, i, next;
+	if (f->queueSend) { tsf_queue_push(f->queueSend, TSF_EVENT_CHANNEL_SOUNDS_OFF_ALL, channel, 0, 0, 0); return; }
+	if (!f->channels || channel < 0 || channel >= f->channels->channelNum) return;
+	for (key = 0; key != 128; key++)
+		for (i = f->channels->channels[channel].keyVoices[key]; i != -1; i = next)
+		{
+			struct tsf_voice* v = &f->voices[i];
+			next = v->keyNext;
+			if (v->playingPreset == -1) tsf_voice_unlinkkey(f, v);
+			else if (v->ampenv.segment < TSF_SEGMENT_RELEASE || v->ampenv.parameters.release) tsf_voice_endquick(f, v);
+		}
 }
 
 TSFDEF int tsf_channel_midi_control(tsf* f, int channel, int controller, int control_value)
 {
-	struct tsf_channel* c = tsf_channel_init(f, channel);
+	struct tsf_channel* c;
+	if (f->queueSend) return tsf_queue_push(f->queueSend, TSF_EVENT_CHANNEL_MIDI_CONTROL, channel, controller, control_value, 0);
+	c = tsf_channel_init(f, channel);
 	if (!c) return 0;
 	switch (controller)
 	{
@@ -2044,7 +3943,7 @@ TSFDEF int tsf_channel_get_preset_bank(tsf* f, int channel)
 
 TSFDEF int tsf_channel_get_preset_number(tsf* f, int channel)
 {
-	return (f->channels && channel < f->channels->channelNum ? f->presets[f->channels->channels[channel].presetIndex].preset : 0);
+	return (f->channels && channel < f->channels->channelNum ? f->font->presets[f->channels->channels[channel].presetIndex].preset : 0);
 }
 
 TSFDEF float tsf_channel_get_pan(tsf* f, int channel)
@@ -2072,6 +3971,11 @@ TSFDEF float tsf_channel_get_tuning(tsf* f, int channel)
 	return (f->channels && channel < f->channels->channelNum ? f->channels->channels[channel].tuning : 0.0f);
 }
 
+TSFDEF int tsf_channel_get_priority(tsf* f, int channel)
+{
+	return (f->channels && channel < f->channels->channelNum ? f->channels->channels[channel].priority : 0);
+}
+
 #ifdef __cplusplus
 }
 #endif